@@ -0,0 +1,385 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "float.h"
+#include "include/aabb.h"
+#include "include/aarect.h"
+#include "include/box.h"
+#include "include/bvh.h"
+#include "include/material.h"
+#include "include/moving_sphere.h"
+#include "include/perlin.h"
+#include "include/random.h"
+#include "include/sphere.h"
+#include "include/texture.h"
+
+/*
+ * Microbenchmarks of the intersection, traversal and texture kernels. Each kernel runs a fixed set of
+ * queries generated up front, once or more to warm up and then reps times; the rates of the timed
+ * repetitions are reported as CSV or JSON on stdout, one row per kernel and scene size.
+ */
+
+struct Bench_options {
+    int reps;
+    int warmup;
+    int n_queries;
+    long max_prims;      // largest synthetic BVH scene
+    const char* filter;  // run only kernels whose name contains it, NULL for all
+    bool json;
+    uint64_t seed;
+    int n_threads;  // BVH build threads, 0: one per hardware thread
+};
+
+struct Bench_result {
+    std::string kernel;
+    long n_prims;  // primitives of the scene, 1 for single-primitive kernels
+    int n_queries;
+    double build_time;  // seconds, BVH kernels only
+    double hit_fraction;
+    std::vector<double> rates;  // queries per second of each timed repetition
+};
+
+// Written after every repetition so the kernels' results are live
+volatile double bench_sink = 0;
+
+void print_usage(const char* prog)
+{
+    std::cerr << "usage: " << prog << " [options]\n"
+              << "  --reps N          timed repetitions per kernel (default: 10)\n"
+              << "  --warmup N        untimed repetitions first (default: 1)\n"
+              << "  --queries N       rays or lookups per repetition (default: 1048576)\n"
+              << "  --max-prims N     largest synthetic BVH scene, from 1000 up by tens (default: 10000000)\n"
+              << "  --filter S        only kernels whose name contains S\n"
+              << "  --format F        csv | json (default: csv)\n"
+              << "  --seed N          seed of the scenes and queries (default: 0)\n"
+              << "  --threads N       BVH build threads (default: hardware concurrency)\n";
+}
+
+bool parse_options(int argc, char** argv, Bench_options& opts)
+{
+    opts.reps = 10;
+    opts.warmup = 1;
+    opts.n_queries = 1 << 20;
+    opts.max_prims = 10000000;
+    opts.filter = NULL;
+    opts.json = false;
+    opts.seed = 0;
+    opts.n_threads = 0;
+    for (int a = 1; a < argc; a++) {
+        bool has_value = a + 1 < argc;
+        if (!strcmp(argv[a], "--reps") && has_value) {
+            opts.reps = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--warmup") && has_value) {
+            opts.warmup = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--queries") && has_value) {
+            opts.n_queries = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--max-prims") && has_value) {
+            opts.max_prims = atol(argv[++a]);
+        } else if (!strcmp(argv[a], "--filter") && has_value) {
+            opts.filter = argv[++a];
+        } else if (!strcmp(argv[a], "--format") && has_value) {
+            const char* format = argv[++a];
+            if (!strcmp(format, "csv"))
+                opts.json = false;
+            else if (!strcmp(format, "json"))
+                opts.json = true;
+            else
+                return false;
+        } else if (!strcmp(argv[a], "--seed") && has_value) {
+            opts.seed = strtoull(argv[++a], NULL, 10);
+        } else if (!strcmp(argv[a], "--threads") && has_value) {
+            opts.n_threads = atoi(argv[++a]);
+        } else {
+            return false;
+        }
+    }
+    return opts.reps > 0 && opts.warmup >= 0 && opts.n_queries > 0 && opts.max_prims > 0 && opts.n_threads >= 0;
+}
+
+bool selected(const Bench_options& opts, const char* kernel) { return !opts.filter || strstr(kernel, opts.filter); }
+
+inline vec3 random_in_box(const vec3& lo, const vec3& hi)
+{
+    return vec3(lo[0] + (hi[0] - lo[0]) * random_float(), lo[1] + (hi[1] - lo[1]) * random_float(), lo[2] + (hi[2] - lo[2]) * random_float());
+}
+
+inline vec3 random_on_sphere(float radius)
+{
+    float z = 1 - 2 * random_float();
+    float phi = 2 * M_PI * random_float();
+    float s = sqrt(1 - z * z);
+    return radius * vec3(cos(phi) * s, sin(phi) * s, z);
+}
+
+/*
+ * Rays from a sphere of radius distance around the origin toward points of the box [lo, hi], at
+ * random times of the shutter interval [0, 1]
+ */
+std::vector<Ray> make_rays(int n, float distance, const vec3& lo, const vec3& hi)
+{
+    std::vector<Ray> rays;
+    rays.reserve(n);
+    for (int k = 0; k < n; k++) {
+        vec3 o = random_on_sphere(distance);
+        rays.push_back(Ray(o, random_in_box(lo, hi) - o, random_float()));
+    }
+    return rays;
+}
+
+/*
+ * Runs query(k) for k in [0, n_queries) warmup + reps times, timing the last reps. query returns
+ * 1 on a hit, or any value to keep live for lookups.
+ */
+template <typename F>
+void run_kernel(const Bench_options& opts, Bench_result& result, const F& query)
+{
+    typedef std::chrono::steady_clock Clock;
+    result.n_queries = opts.n_queries;
+    for (int rep = 0; rep < opts.warmup + opts.reps; rep++) {
+        double sum = 0;
+        Clock::time_point start = Clock::now();
+        for (int k = 0; k < opts.n_queries; k++) sum += query(k);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        bench_sink = sum;
+        if (rep < opts.warmup) continue;
+        result.rates.push_back(opts.n_queries / std::max(seconds, 1e-9));
+        result.hit_fraction = sum / opts.n_queries;
+    }
+}
+
+/*
+ * Closest-hit rays against one primitive, aimed at the box [-1, 1]^3 around it from distance 3
+ */
+Bench_result bench_hitable(const Bench_options& opts, const char* kernel, const Hitable* h)
+{
+    Bench_result result;
+    result.kernel = kernel;
+    result.n_prims = 1;
+    result.build_time = 0;
+    std::vector<Ray> rays = make_rays(opts.n_queries, 3, vec3(-1, -1, -1), vec3(1, 1, 1));
+    run_kernel(opts, result, [&](int k) {
+        Hit_record rec;
+        return h->hit(rays[k], 0.001, FLT_MAX, rec) ? 1.0 : 0.0;
+    });
+    return result;
+}
+
+Bench_result bench_aabb(const Bench_options& opts)
+{
+    Bench_result result;
+    result.kernel = "aabb";
+    result.n_prims = 1;
+    result.build_time = 0;
+    Aabb box(vec3(-0.5, -0.5, -0.5), vec3(0.5, 0.5, 0.5));
+    std::vector<Ray> rays = make_rays(opts.n_queries, 3, vec3(-1, -1, -1), vec3(1, 1, 1));
+    run_kernel(opts, result, [&](int k) { return box.hit(rays[k], 0.001, FLT_MAX) ? 1.0 : 0.0; });
+    return result;
+}
+
+/*
+ * Frees the interior nodes and leaf lists of a Bvh_node tree, but not the primitives it points to
+ */
+void delete_bvh_nodes(Bvh_node* node)
+{
+    if (node->left == node->right) {
+        Hitable_list* leaf = dynamic_cast<Hitable_list*>(node->left);
+        if (leaf) {
+            delete[] leaf->list;
+            delete leaf;
+        }
+    } else {
+        Hitable* children[2] = { node->left, node->right };
+        for (int c = 0; c < 2; c++) {
+            Bvh_node* child = dynamic_cast<Bvh_node*>(children[c]);
+            if (child) delete_bvh_nodes(child);
+        }
+    }
+    delete node;
+}
+
+/*
+ * Closest-hit rays through each selected BVH layout over n_prims random spheres in the unit cube, of
+ * a quarter of their mean spacing. Keeping the radius in proportion to the spacing keeps the sphere
+ * test well conditioned, so hit fractions agree across layouts; they rise with n_prims. Each layout
+ * is freed once timed and the spheres before the next size is built, so sizes do not add up in memory.
+ */
+void bench_bvh(const Bench_options& opts, long n_prims, Material* mat, std::vector<Bench_result>& results)
+{
+    const char* names[3] = { "bvh_node", "linear_bvh", "bvh4" };
+    Bvh_layout layouts[3] = { BVH_LAYOUT_NODE, BVH_LAYOUT_LINEAR, BVH_LAYOUT_BVH4 };
+    std::vector<Hitable*> list;
+    std::vector<Ray> rays;
+    for (int i = 0; i < 3; i++) {
+        if (!selected(opts, names[i])) continue;
+        std::cerr << names[i] << " " << n_prims << "\n";
+        if (list.empty()) {
+            thread_rng().seed(opts.seed, uint64_t(n_prims));
+            float radius = 0.25f / cbrt(float(n_prims));
+            list.resize(n_prims);
+            for (long k = 0; k < n_prims; k++) list[k] = new Sphere(random_in_box(vec3(0, 0, 0), vec3(1, 1, 1)), radius, mat);
+            rays = make_rays(opts.n_queries, 2, vec3(0, 0, 0), vec3(1, 1, 1));
+        }
+
+        Bench_result result;
+        result.kernel = names[i];
+        result.n_prims = n_prims;
+        Bvh_build_params params;
+        params.layout = layouts[i];
+        params.n_threads = opts.n_threads;
+        std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+        Hitable* bvh = make_bvh(&list[0], int(n_prims), 0, 1, params);
+        result.build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        run_kernel(opts, result, [&](int k) {
+            Hit_record rec;
+            return bvh->hit(rays[k], 0.001, FLT_MAX, rec) ? 1.0 : 0.0;
+        });
+        // The flattened layouts own only their vectors; a Bvh_node tree is freed node by node
+        if (layouts[i] == BVH_LAYOUT_NODE)
+            delete_bvh_nodes(static_cast<Bvh_node*>(bvh));
+        else
+            delete bvh;
+        results.push_back(result);
+    }
+    for (size_t k = 0; k < list.size(); k++) delete list[k];
+}
+
+Bench_result bench_perlin_turb(const Bench_options& opts)
+{
+    Bench_result result;
+    result.kernel = "perlin_turb";
+    result.n_prims = 1;
+    result.build_time = 0;
+    Perlin noise;
+    std::vector<vec3> points(opts.n_queries);
+    for (int k = 0; k < opts.n_queries; k++) points[k] = random_in_box(vec3(-50, -50, -50), vec3(50, 50, 50));
+    run_kernel(opts, result, [&](int k) { return double(noise.turb(points[k])); });
+    result.hit_fraction = 0;
+    return result;
+}
+
+/*
+ * Lookups at random uv in a 2048x1024 texture of random texels, the size of the bundled earth map
+ */
+Bench_result bench_image_texture(const Bench_options& opts)
+{
+    Bench_result result;
+    result.kernel = "image_texture";
+    result.n_prims = 1;
+    result.build_time = 0;
+    int nx = 2048, ny = 1024;
+    std::vector<unsigned char> pixels(3 * nx * ny);
+    for (size_t k = 0; k < pixels.size(); k++) pixels[k] = (unsigned char)(256 * random_float());
+    Image_texture texture(&pixels[0], nx, ny);
+    std::vector<float> uv(2 * opts.n_queries);
+    for (size_t k = 0; k < uv.size(); k++) uv[k] = random_float();
+    vec3 p(0, 0, 0);
+    run_kernel(opts, result, [&](int k) { return double(texture.value(uv[2 * k], uv[2 * k + 1], p)[1]); });
+    result.hit_fraction = 0;
+    return result;
+}
+
+struct Rate_stats {
+    double median, min, max, mean, stddev;
+};
+
+Rate_stats rate_stats(std::vector<double> rates)
+{
+    Rate_stats s;
+    std::sort(rates.begin(), rates.end());
+    size_t n = rates.size();
+    s.median = n % 2 ? rates[n / 2] : 0.5 * (rates[n / 2 - 1] + rates[n / 2]);
+    s.min = rates.front();
+    s.max = rates.back();
+    double sum = 0, sum2 = 0;
+    for (size_t k = 0; k < n; k++) {
+        sum += rates[k];
+        sum2 += rates[k] * rates[k];
+    }
+    s.mean = sum / n;
+    s.stddev = n > 1 ? sqrt(std::max(0.0, (sum2 - sum * s.mean) / (n - 1))) : 0;
+    return s;
+}
+
+// Rates are printed in millions of queries per second
+void print_csv(const std::vector<Bench_result>& results)
+{
+    printf("kernel,primitives,queries,reps,median_mqps,min_mqps,max_mqps,mean_mqps,stddev_mqps,hit_fraction,build_s\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Bench_result& r = results[i];
+        Rate_stats s = rate_stats(r.rates);
+        printf("%s,%ld,%d,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n", r.kernel.c_str(), r.n_prims, r.n_queries, int(r.rates.size()), s.median * 1e-6,
+               s.min * 1e-6, s.max * 1e-6, s.mean * 1e-6, s.stddev * 1e-6, r.hit_fraction, r.build_time);
+    }
+}
+
+void print_json(const std::vector<Bench_result>& results, const Bench_options& opts)
+{
+#ifdef VEC3_SSE
+    const char* vec3_storage = "sse";
+#else
+    const char* vec3_storage = "scalar";
+#endif
+    printf("{\n  \"vec3\": \"%s\",\n  \"seed\": %llu,\n  \"warmup\": %d,\n  \"results\": [\n", vec3_storage, (unsigned long long)opts.seed, opts.warmup);
+    for (size_t i = 0; i < results.size(); i++) {
+        const Bench_result& r = results[i];
+        Rate_stats s = rate_stats(r.rates);
+        printf("    {\"kernel\": \"%s\", \"primitives\": %ld, \"queries\": %d, \"reps\": %d, \"median_mqps\": %.4f, \"min_mqps\": %.4f, "
+               "\"max_mqps\": %.4f, \"mean_mqps\": %.4f, \"stddev_mqps\": %.4f, \"hit_fraction\": %.4f, \"build_s\": %.4f}%s\n",
+               r.kernel.c_str(), r.n_prims, r.n_queries, int(r.rates.size()), s.median * 1e-6, s.min * 1e-6, s.max * 1e-6, s.mean * 1e-6,
+               s.stddev * 1e-6, r.hit_fraction, r.build_time, i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+    Bench_options opts;
+    if (!parse_options(argc, argv, opts)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    thread_rng().seed(opts.seed, 0);
+    Material* mat = new Lambertian(new Constant_texture(vec3(0.5, 0.5, 0.5)));
+
+    std::vector<Bench_result> results;
+    Sphere sphere(vec3(0, 0, 0), 0.5, mat);
+    Moving_sphere moving_sphere(vec3(-0.25, 0, 0), vec3(0.25, 0, 0), 0, 1, 0.5, mat);
+    XY_rect xy_rect(-0.5, 0.5, -0.5, 0.5, 0, mat);
+    XZ_rect xz_rect(-0.5, 0.5, -0.5, 0.5, 0, mat);
+    YZ_rect yz_rect(-0.5, 0.5, -0.5, 0.5, 0, mat);
+    Box box(vec3(-0.5, -0.5, -0.5), vec3(0.5, 0.5, 0.5), mat);
+    const char* names[6] = { "sphere", "moving_sphere", "xy_rect", "xz_rect", "yz_rect", "box" };
+    const Hitable* hitables[6] = { &sphere, &moving_sphere, &xy_rect, &xz_rect, &yz_rect, &box };
+    for (int i = 0; i < 6; i++) {
+        if (!selected(opts, names[i])) continue;
+        std::cerr << names[i] << "\n";
+        results.push_back(bench_hitable(opts, names[i], hitables[i]));
+    }
+    if (selected(opts, "aabb")) {
+        std::cerr << "aabb\n";
+        results.push_back(bench_aabb(opts));
+    }
+
+    for (long n = 1000; n <= opts.max_prims; n *= 10) bench_bvh(opts, n, mat, results);
+
+    if (selected(opts, "perlin_turb")) {
+        std::cerr << "perlin_turb\n";
+        results.push_back(bench_perlin_turb(opts));
+    }
+    if (selected(opts, "image_texture")) {
+        std::cerr << "image_texture\n";
+        results.push_back(bench_image_texture(opts));
+    }
+
+    if (opts.json)
+        print_json(results, opts);
+    else
+        print_csv(results);
+    return 0;
+}
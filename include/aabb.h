@@ -1,10 +1,16 @@
 #ifndef AABBH
 #define AABBH
 
+#include <float.h>
+
 #include "ray.h"
 
 inline float ffmin(float a, float b) { return a < b ? a : b; }
 inline float ffmax(float a, float b) { return a > b ? a : b; }
+
+// Far slab distances are scaled up by 2 * gamma(3) so rounding cannot reject rays grazing a box corner
+const float slab_far_scale = 1.0f + 2.0f * 3.0f * FLT_EPSILON / (1.0f - 3.0f * FLT_EPSILON);
+
 class Aabb
 {
   public:
@@ -16,16 +22,32 @@ class Aabb
     }
     vec3 min() { return _min; }
     vec3 max() { return _max; }
+    /*
+     * Slab test with the ray's cached reciprocal direction, whose sign picks the near and far plane of
+     * each axis. The slab distance comes first in ffmin/ffmax so a NaN (origin on a plane the ray runs
+     * along) leaves the interval as it was.
+     */
     bool hit(const Ray& r, float tmin, float tmax) const
     {
         for (int a = 0; a < 3; a++) {
-            float t0 = ffmin((_min[a] - r.origin()[a]) / r.direction()[a], (_max[a] - r.origin()[a]) / r.direction()[a]);
-            float t1 = ffmax((_min[a] - r.origin()[a]) / r.direction()[a], (_max[a] - r.origin()[a]) / r.direction()[a]);
-            tmin = ffmax(0, tmin);
-            tmax = ffmin(t1, tmax);
-            if (tmax <= tmin) return false;
+            float lo = r.dir_is_neg[a] ? _max[a] : _min[a];
+            float hi = r.dir_is_neg[a] ? _min[a] : _max[a];
+            tmin = ffmax((lo - r.A[a]) * r.inv_dir[a], tmin);
+            tmax = ffmin((hi - r.A[a]) * r.inv_dir[a] * slab_far_scale, tmax);
+        }
+        return tmin <= tmax;
+    }
+    float area() const
+    {
+        vec3 d = _max - _min;
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+    void expand(const Aabb& b)
+    {
+        for (int a = 0; a < 3; a++) {
+            _min[a] = ffmin(_min[a], b._min[a]);
+            _max[a] = ffmax(_max[a], b._max[a]);
         }
-        return true;
     }
     vec3 _min;
     vec3 _max;
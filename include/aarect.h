@@ -1,7 +1,12 @@
 #ifndef AARECTH
 #define AARECTH
 
+#include <float.h>
+
 #include "hitable.h"
+#include "material.h"
+#include "random.h"
+#include "render_stats.h"
 
 class XY_rect : public Hitable
 {
@@ -14,6 +19,14 @@ class XY_rect : public Hitable
         box = Aabb(vec3(x0, y0, k - 0.0001), vec3(x1, y1, k + 0.0001));
         return true;
     }
+    virtual void finalize(const Ray& r, Hit_record& rec) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const;
+    virtual float pdf_value(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const;
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        if (mp->is_emitter()) lights.push_back(this);
+    }
     Material* mp;
     float x0, x1, y0, y1, k;
 };
@@ -29,6 +42,14 @@ class XZ_rect : public Hitable
         box = Aabb(vec3(x0, k - 0.0001, z0), vec3(x1, k + 0.0001, z1));
         return true;
     }
+    virtual void finalize(const Ray& r, Hit_record& rec) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const;
+    virtual float pdf_value(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const;
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        if (mp->is_emitter()) lights.push_back(this);
+    }
     Material* mp;
     float x0, x1, z0, z1, k;
 };
@@ -44,54 +65,154 @@ class YZ_rect : public Hitable
         box = Aabb(vec3(k - 0.0001, y0, z0), vec3(k + 0.0001, y1, z1));
         return true;
     }
+    virtual void finalize(const Ray& r, Hit_record& rec) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const;
+    virtual float pdf_value(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const;
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        if (mp->is_emitter()) lights.push_back(this);
+    }
     Material* mp;
     float y0, y1, z0, z1, k;
 };
 
 bool XY_rect::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
 {
+    STAT_INC(STAT_RECT_TESTS);
     float t = (k - r.origin().z()) / r.direction().z();
     if (t < t_min || t > t_max) return false;
     float x = r.origin().x() + t * r.direction().x();
     float y = r.origin().y() + t * r.direction().y();
     if (x < x0 || x > x1 || y < y0 || y > y1) return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (y - y0) / (y1 - y0);
+    rec.u = x;
+    rec.v = y;
     rec.t = t;
+    rec.hitable = this;
+    return true;
+}
+
+void XY_rect::finalize(const Ray& r, Hit_record& rec) const
+{
+    rec.u = (rec.u - x0) / (x1 - x0);
+    rec.v = (rec.v - y0) / (y1 - y0);
     rec.mat_ptr = mp;
-    rec.p = r.point_at_parameter(t);
+    rec.p = r.point_at_parameter(rec.t);
     rec.normal = vec3(0, 0, 1);
-    return true;
 }
 
 bool XZ_rect::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
 {
+    STAT_INC(STAT_RECT_TESTS);
     float t = (k - r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max) return false;
     float x = r.origin().x() + t * r.direction().x();
     float z = r.origin().z() + t * r.direction().z();
     if (x < x0 || x > x1 || z < z0 || z > z1) return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (z - z0) / (z1 - z0);
+    rec.u = x;
+    rec.v = z;
     rec.t = t;
+    rec.hitable = this;
+    return true;
+}
+
+void XZ_rect::finalize(const Ray& r, Hit_record& rec) const
+{
+    rec.u = (rec.u - x0) / (x1 - x0);
+    rec.v = (rec.v - z0) / (z1 - z0);
     rec.mat_ptr = mp;
-    rec.p = r.point_at_parameter(t);
+    rec.p = r.point_at_parameter(rec.t);
     rec.normal = vec3(0, 1, 0);
-    return true;
 }
+
 bool YZ_rect::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
 {
+    STAT_INC(STAT_RECT_TESTS);
     float t = (k - r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max) return false;
     float y = r.origin().y() + t * r.direction().y();
     float z = r.origin().z() + t * r.direction().z();
     if (y < y0 || y > y1 || z < z0 || z > z1) return false;
-    rec.u = (y - y0) / (y1 - y0);
-    rec.v = (z - z0) / (z1 - z0);
+    rec.u = y;
+    rec.v = z;
     rec.t = t;
+    rec.hitable = this;
+    return true;
+}
+
+void YZ_rect::finalize(const Ray& r, Hit_record& rec) const
+{
+    rec.u = (rec.u - y0) / (y1 - y0);
+    rec.v = (rec.v - z0) / (z1 - z0);
     rec.mat_ptr = mp;
-    rec.p = r.point_at_parameter(t);
+    rec.p = r.point_at_parameter(rec.t);
     rec.normal = vec3(1, 0, 0);
-    return true;
 }
+
+bool XY_rect::occluded(const Ray& r, float t_min, float t_max) const
+{
+    STAT_INC(STAT_RECT_TESTS);
+    float t = (k - r.origin().z()) / r.direction().z();
+    if (t < t_min || t > t_max) return false;
+    float x = r.origin().x() + t * r.direction().x();
+    float y = r.origin().y() + t * r.direction().y();
+    return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+}
+
+bool XZ_rect::occluded(const Ray& r, float t_min, float t_max) const
+{
+    STAT_INC(STAT_RECT_TESTS);
+    float t = (k - r.origin().y()) / r.direction().y();
+    if (t < t_min || t > t_max) return false;
+    float x = r.origin().x() + t * r.direction().x();
+    float z = r.origin().z() + t * r.direction().z();
+    return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+}
+
+bool YZ_rect::occluded(const Ray& r, float t_min, float t_max) const
+{
+    STAT_INC(STAT_RECT_TESTS);
+    float t = (k - r.origin().x()) / r.direction().x();
+    if (t < t_min || t > t_max) return false;
+    float y = r.origin().y() + t * r.direction().y();
+    float z = r.origin().z() + t * r.direction().z();
+    return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+}
+
+/*
+ * Rectangles are sampled uniformly by area; the solid-angle density is distance^2 / (cosine * area)
+ */
+float XY_rect::pdf_value(const vec3& o, const vec3& v) const
+{
+    Hit_record rec;
+    if (!hit(Ray(o, v), 0.001, FLT_MAX, rec)) return 0;
+    float distance_squared = rec.t * rec.t * v.squared_length();
+    float cosine = fabs(v.z() / v.length());
+    return distance_squared / (cosine * (x1 - x0) * (y1 - y0));
+}
+
+vec3 XY_rect::random(const vec3& o) const { return vec3(x0 + random_float() * (x1 - x0), y0 + random_float() * (y1 - y0), k) - o; }
+
+float XZ_rect::pdf_value(const vec3& o, const vec3& v) const
+{
+    Hit_record rec;
+    if (!hit(Ray(o, v), 0.001, FLT_MAX, rec)) return 0;
+    float distance_squared = rec.t * rec.t * v.squared_length();
+    float cosine = fabs(v.y() / v.length());
+    return distance_squared / (cosine * (x1 - x0) * (z1 - z0));
+}
+
+vec3 XZ_rect::random(const vec3& o) const { return vec3(x0 + random_float() * (x1 - x0), k, z0 + random_float() * (z1 - z0)) - o; }
+
+float YZ_rect::pdf_value(const vec3& o, const vec3& v) const
+{
+    Hit_record rec;
+    if (!hit(Ray(o, v), 0.001, FLT_MAX, rec)) return 0;
+    float distance_squared = rec.t * rec.t * v.squared_length();
+    float cosine = fabs(v.x() / v.length());
+    return distance_squared / (cosine * (y1 - y0) * (z1 - z0));
+}
+
+vec3 YZ_rect::random(const vec3& o) const { return vec3(k, y0 + random_float() * (y1 - y0), z0 + random_float() * (z1 - z0)) - o; }
+
 #endif  // AARECTH
\ No newline at end of file
@@ -16,6 +16,8 @@ class Box : public Hitable
         box = Aabb(pmin, pmax);
         return true;
     }
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const { return list_ptr->occluded(r, t_min, t_max); }
+    virtual void collect_lights(std::vector<Hitable*>& lights) { list_ptr->collect_lights(lights); }
     vec3 pmin, pmax;
     Hitable* list_ptr;
 };
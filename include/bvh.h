@@ -0,0 +1,19 @@
+#ifndef BVHH
+#define BVHH
+
+#include "bvh4.h"
+#include "bvh_build.h"
+#include "bvh_node.h"
+#include "linear_bvh.h"
+
+/*
+ * Builds the acceleration structure selected by params.layout over l[0, n)
+ */
+Hitable* make_bvh(Hitable** l, int n, float time0, float time1, const Bvh_build_params& params)
+{
+    if (params.layout == BVH_LAYOUT_LINEAR) return new Linear_bvh(l, n, time0, time1, params);
+    if (params.layout == BVH_LAYOUT_BVH4) return new Bvh4(l, n, time0, time1, params);
+    return new Bvh_node(l, n, time0, time1, params);
+}
+
+#endif  // BVHH
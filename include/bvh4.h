@@ -0,0 +1,284 @@
+#ifndef BVH4H
+#define BVH4H
+
+#include <assert.h>
+#include <chrono>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define BVH4_SSE
+#endif
+
+#include "bvh_build.h"
+#include "hitable.h"
+#include "linear_bvh.h"
+#include "render_stats.h"
+
+/*
+ * Four-wide node with child bounds stored per axis (SoA), so one SIMD register holds the same slab of
+ * all four children. count[i] > 0 marks a leaf of count[i] primitives starting at child[i], 0 an inner
+ * node at child[i] and -1 an unused slot whose empty bounds can never be hit.
+ */
+struct Bvh4_node {
+    float bmin[3][4];
+    float bmax[3][4];
+    int child[4];
+    int count[4];
+};
+
+/*
+ * Collapsing never deepens the binary tree, so inner nodes are at most bvh_max_depth - 1 deep. Above
+ * the current node every level leaves at most three siblings on the traversal stack, and the node
+ * pushes up to four children.
+ */
+const int bvh4_stack_size = 3 * (bvh_max_depth - 1) + 4;
+
+/*
+ * Slab test of the four children of node against r. Writes the entry distances and returns a bit mask
+ * of the children whose boxes overlap [t_min, t_max].
+ */
+inline int node4_hit(const Bvh4_node& node, const Ray& r, float t_min, float t_max, float t_entry[4])
+{
+    STAT_INC(STAT_BVH_NODES);
+#ifdef BVH4_SSE
+    __m128 tnear = _mm_set1_ps(t_min);
+    __m128 tfar = _mm_set1_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+        // With the reciprocal direction's sign known, the near and far planes need no min/max. The
+        // slab distance is the first operand, so a NaN one leaves the interval as it was.
+        const float* lo = r.dir_is_neg[a] ? node.bmax[a] : node.bmin[a];
+        const float* hi = r.dir_is_neg[a] ? node.bmin[a] : node.bmax[a];
+        __m128 o = _mm_set1_ps(r.A[a]);
+        __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+        tnear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(lo), o), inv), tnear);
+        tfar = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(hi), o), inv), _mm_set1_ps(slab_far_scale)), tfar);
+    }
+    _mm_storeu_ps(t_entry, tnear);
+    return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+#else
+    int mask = 0;
+    for (int c = 0; c < 4; c++) {
+        float tnear = t_min;
+        float tfar = t_max;
+        for (int a = 0; a < 3; a++) {
+            float lo = r.dir_is_neg[a] ? node.bmax[a][c] : node.bmin[a][c];
+            float hi = r.dir_is_neg[a] ? node.bmin[a][c] : node.bmax[a][c];
+            tnear = ffmax((lo - r.A[a]) * r.inv_dir[a], tnear);
+            tfar = ffmin((hi - r.A[a]) * r.inv_dir[a] * slab_far_scale, tfar);
+        }
+        t_entry[c] = tnear;
+        if (tnear <= tfar) mask |= 1 << c;
+    }
+    return mask;
+#endif
+}
+
+/**************************************************************************************************************/
+/*
+ * Class Bvh4
+ *
+ * Wide BVH obtained by collapsing a binary Linear_bvh: each node pulls up grandchildren, largest
+ * surface area first, until it has four children.
+ */
+class Bvh4 : public Hitable
+{
+  public:
+    Bvh4(Hitable** l, int n, float time0, float time1, const Bvh_build_params& params = Bvh_build_params());
+    virtual bool hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const;
+    virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const;
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        for (size_t i = 0; i < primitives.size(); i++) primitives[i]->collect_lights(lights);
+    }
+    std::vector<Bvh4_node> nodes;
+    std::vector<Hitable*> primitives;
+    Aabb bounds;
+
+  private:
+    int collapse(const std::vector<Linear_bvh_node>& binary, int root);
+};
+
+Bvh4::Bvh4(Hitable** l, int n, float time0, float time1, const Bvh_build_params& params)
+{
+    if (n == 0) return;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+    std::vector<Bvh_primitive> prims;
+    compute_primitive_bounds(l, n, time0, time1, params, prims);
+
+    Bvh_build_stats binary_stats;
+    Bvh_build_params binary_params = params;
+    binary_params.stats = &binary_stats;
+    std::vector<Linear_bvh_node> binary;
+    binary.reserve(2 * n);
+    float cost = build_linear_bvh(prims, 0, n, binary_params, binary);
+    primitives.resize(n);
+    for (int i = 0; i < n; i++) primitives[i] = l[prims[i].index];
+
+    const Linear_bvh_node& root = binary[0];
+    bounds = Aabb(vec3(root.bmin[0], root.bmin[1], root.bmin[2]), vec3(root.bmax[0], root.bmax[1], root.bmax[2]));
+    nodes.reserve(binary.size() / 2 + 1);
+    collapse(binary, 0);
+
+    if (params.stats) {
+        params.stats->n_builds++;
+        params.stats->n_primitives += n;
+        params.stats->n_nodes += long(nodes.size());
+        params.stats->n_leaves += binary_stats.n_leaves;
+        params.stats->sah_cost += cost;
+        params.stats->build_time += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+}
+
+int Bvh4::collapse(const std::vector<Linear_bvh_node>& binary, int root)
+{
+    int self = int(nodes.size());
+    nodes.push_back(Bvh4_node());
+
+    int kids[4];
+    int n_kids = 0;
+    if (binary[root].n_primitives > 0) {
+        kids[n_kids++] = root;  // single leaf tree
+    } else {
+        kids[n_kids++] = root + 1;
+        kids[n_kids++] = binary[root].second_child_offset;
+    }
+    while (n_kids < 4) {
+        int best = -1;
+        float best_area = -1;
+        for (int k = 0; k < n_kids; k++) {
+            const Linear_bvh_node& b = binary[kids[k]];
+            if (b.n_primitives > 0) continue;
+            Aabb box(vec3(b.bmin[0], b.bmin[1], b.bmin[2]), vec3(b.bmax[0], b.bmax[1], b.bmax[2]));
+            if (box.area() > best_area) {
+                best_area = box.area();
+                best = k;
+            }
+        }
+        if (best < 0) break;
+        int expanded = kids[best];
+        kids[best] = expanded + 1;
+        kids[n_kids++] = binary[expanded].second_child_offset;
+    }
+
+    for (int c = 0; c < 4; c++) {
+        int child = 0;
+        int count = -1;
+        if (c < n_kids) {
+            const Linear_bvh_node& b = binary[kids[c]];
+            if (b.n_primitives > 0) {
+                child = b.primitives_offset;
+                count = b.n_primitives;
+            } else {
+                child = collapse(binary, kids[c]);
+                count = 0;
+            }
+        }
+        // nodes may have been reallocated by the recursion above
+        Bvh4_node& node = nodes[self];
+        for (int a = 0; a < 3; a++) {
+            node.bmin[a][c] = c < n_kids ? binary[kids[c]].bmin[a] : FLT_MAX;
+            node.bmax[a][c] = c < n_kids ? binary[kids[c]].bmax[a] : -FLT_MAX;
+        }
+        node.child[c] = child;
+        node.count[c] = count;
+    }
+    return self;
+}
+
+bool Bvh4::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
+{
+    if (nodes.empty()) return false;
+    // Entries are (count, child, entry distance); the root is pushed as an inner node
+    const Bvh4_node* node_array = &nodes[0];
+    int stack_child[bvh4_stack_size];
+    int stack_count[bvh4_stack_size];
+    float stack_t[bvh4_stack_size];
+    int sp = 0;
+    stack_child[sp] = 0;
+    stack_count[sp] = 0;
+    stack_t[sp++] = t_min;
+    bool hit_anything = false;
+    while (sp > 0) {
+        sp--;
+        if (stack_t[sp] > t_max) continue;  // a closer hit was found since this entry was pushed
+        int child = stack_child[sp];
+        int count = stack_count[sp];
+        if (count > 0) {
+            for (int i = 0; i < count; i++) {
+                if (primitives[child + i]->hit(r, t_min, t_max, rec)) {
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+            }
+            continue;
+        }
+
+        const Bvh4_node& node = node_array[child];
+        float t_entry[4];
+        int mask = node4_hit(node, r, t_min, t_max, t_entry);
+        if (mask == 0) continue;
+
+        // Push the hit children farthest first so the nearest one is popped next
+        int order[4];
+        int n_hit = 0;
+        for (int c = 0; c < 4; c++) {
+            if (!(mask & (1 << c))) continue;
+            int k = n_hit++;
+            while (k > 0 && t_entry[order[k - 1]] < t_entry[c]) {
+                order[k] = order[k - 1];
+                k--;
+            }
+            order[k] = c;
+        }
+        assert(sp + n_hit <= bvh4_stack_size);
+        for (int k = 0; k < n_hit; k++) {
+            stack_child[sp] = node.child[order[k]];
+            stack_count[sp] = node.count[order[k]];
+            stack_t[sp++] = t_entry[order[k]];
+        }
+    }
+    return hit_anything;
+}
+
+bool Bvh4::occluded(const Ray& r, float t_min, float t_max) const
+{
+    if (nodes.empty()) return false;
+    // Any hit will do, so children are pushed in slot order
+    const Bvh4_node* node_array = &nodes[0];
+    int stack_child[bvh4_stack_size];
+    int stack_count[bvh4_stack_size];
+    int sp = 0;
+    stack_child[sp] = 0;
+    stack_count[sp++] = 0;
+    while (sp > 0) {
+        sp--;
+        int child = stack_child[sp];
+        int count = stack_count[sp];
+        if (count > 0) {
+            for (int i = 0; i < count; i++)
+                if (primitives[child + i]->occluded(r, t_min, t_max)) return true;
+            continue;
+        }
+        const Bvh4_node& node = node_array[child];
+        float t_entry[4];
+        int mask = node4_hit(node, r, t_min, t_max, t_entry);
+        assert(sp + 4 <= bvh4_stack_size);
+        for (int c = 0; c < 4; c++) {
+            if (!(mask & (1 << c))) continue;
+            stack_child[sp] = node.child[c];
+            stack_count[sp++] = node.count[c];
+        }
+    }
+    return false;
+}
+
+bool Bvh4::bounding_box(float t0, float t1, Aabb& box) const
+{
+    if (nodes.empty()) return false;
+    box = bounds;
+    return true;
+}
+
+#endif  // BVH4H
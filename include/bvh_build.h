@@ -0,0 +1,284 @@
+#ifndef BVHBUILDH
+#define BVHBUILDH
+
+#include <float.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "aabb.h"
+#include "hitable.h"
+#include "parallel.h"
+
+enum Bvh_split_method { BVH_SPLIT_MEDIAN, BVH_SPLIT_SAH };
+enum Bvh_layout { BVH_LAYOUT_NODE, BVH_LAYOUT_LINEAR, BVH_LAYOUT_BVH4 };
+
+/*
+ * Totals over every BVH built with the same stats pointer
+ */
+struct Bvh_build_stats {
+    Bvh_build_stats() : n_builds(0), n_primitives(0), n_nodes(0), n_leaves(0), sah_cost(0), build_time(0) {}
+    void add(const Bvh_build_stats& s)
+    {
+        n_builds += s.n_builds;
+        n_primitives += s.n_primitives;
+        n_nodes += s.n_nodes;
+        n_leaves += s.n_leaves;
+        sah_cost += s.sah_cost;
+        build_time += s.build_time;
+    }
+    int n_builds;
+    long n_primitives;
+    long n_nodes;
+    long n_leaves;
+    double sah_cost;    // sum of the root costs, in units of the params' cost constants
+    double build_time;  // seconds, bounds precomputation included
+};
+
+struct Bvh_build_params {
+    Bvh_build_params()
+      : method(BVH_SPLIT_MEDIAN), layout(BVH_LAYOUT_NODE), n_bins(16), max_leaf_size(4), traversal_cost(1.0f), intersection_cost(1.0f), n_threads(0),
+        stats(NULL)
+    {
+    }
+    Bvh_split_method method;
+    Bvh_layout layout;
+    int n_bins;
+    int max_leaf_size;  // SAH only: larger nodes are always split
+    float traversal_cost;
+    float intersection_cost;
+    int n_threads;  // 0: one per hardware thread
+    Bvh_build_stats* stats;
+};
+
+/*
+ * Bounds of one primitive, computed once per build
+ */
+struct Bvh_primitive {
+    Aabb box;
+    vec3 centroid;
+    int index;
+};
+
+inline Aabb empty_box() { return Aabb(vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX)); }
+
+/*
+ * Deepest node of a flattened BVH, the root being at depth 0. The traversal stacks are sized for it,
+ * so builders fall back to median splits, which halve the node, before a subtree could go deeper.
+ */
+const int bvh_max_depth = 64;
+
+inline int ceil_log2(long n)
+{
+    int k = 0;
+    while ((1L << k) < n) k++;
+    return k;
+}
+
+// Below this many primitives a node is binned and built on a single thread
+const int bvh_parallel_threshold = 1 << 14;
+
+inline int build_threads(const Bvh_build_params& params) { return params.n_threads > 0 ? params.n_threads : hardware_threads(); }
+
+/*
+ * Subtrees are handed to the task pool while there are fewer tasks than threads and enough work to share
+ */
+inline bool bvh_fork(int n, int depth, const Bvh_build_params& params)
+{
+    return n >= bvh_parallel_threshold && (1 << depth) < build_threads(params);
+}
+
+/*
+ * Fills prims with the bounds and centroid of each of l[0, n), in parallel for large inputs
+ */
+void compute_primitive_bounds(Hitable** l, int n, float time0, float time1, const Bvh_build_params& params, std::vector<Bvh_primitive>& prims)
+{
+    prims.resize(n);
+    int n_chunks = n >= bvh_parallel_threshold ? build_threads(params) : 1;
+    parallel_chunks(n, n_chunks, [&](int chunk, long begin, long end) {
+        for (long i = begin; i < end; i++) {
+            if (!l[i]->bounding_box(time0, time1, prims[i].box)) std::cerr << "no bounding box in bvh constructor\n";
+            prims[i].centroid = 0.5 * (prims[i].box._min + prims[i].box._max);
+            prims[i].index = int(i);
+        }
+    });
+}
+
+inline void expand_centroid_bounds(Aabb& cb, const Bvh_primitive* prims, long begin, long end)
+{
+    for (long i = begin; i < end; i++) {
+        for (int a = 0; a < 3; a++) {
+            cb._min[a] = ffmin(cb._min[a], prims[i].centroid[a]);
+            cb._max[a] = ffmax(cb._max[a], prims[i].centroid[a]);
+        }
+    }
+}
+
+/*
+ * Bounds of the centroids of prims[0, n), in n_chunks parallel parts
+ */
+Aabb centroid_bounds(const Bvh_primitive* prims, int n, int n_chunks)
+{
+    Aabb cb = empty_box();
+    if (n_chunks <= 1) {
+        expand_centroid_bounds(cb, prims, 0, n);
+        return cb;
+    }
+    std::vector<Aabb> chunk_bounds(n_chunks, empty_box());
+    parallel_chunks(n, n_chunks, [&](int chunk, long begin, long end) { expand_centroid_bounds(chunk_bounds[chunk], prims, begin, end); });
+    for (int c = 0; c < n_chunks; c++) cb.expand(chunk_bounds[c]);
+    return cb;
+}
+
+/*
+ * Median split of prims[0, n) along the axis of largest centroid extent. The centroid bounds of
+ * large nodes are found in parallel; the selection itself is serial.
+ */
+int bvh_median_split(Bvh_primitive* prims, int n, const Bvh_build_params& params)
+{
+    if (n <= 1) return 0;
+    Aabb cb = centroid_bounds(prims, n, n >= bvh_parallel_threshold ? build_threads(params) : 1);
+    vec3 cmin = cb._min;
+    vec3 cmax = cb._max;
+    int axis = 0;
+    if (cmax[1] - cmin[1] > cmax[axis] - cmin[axis]) axis = 1;
+    if (cmax[2] - cmin[2] > cmax[axis] - cmin[axis]) axis = 2;
+    std::nth_element(prims, prims + n / 2, prims + n,
+                     [=](const Bvh_primitive& a, const Bvh_primitive& b) { return a.centroid[axis] < b.centroid[axis]; });
+    return n / 2;
+}
+
+/*
+ * Per-axis SAH bins of a range of primitives
+ */
+struct Bvh_bins {
+    static const int max_bins = 256;
+    void clear(int n_bins)
+    {
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < n_bins; b++) {
+                counts[a][b] = 0;
+                boxes[a][b] = empty_box();
+            }
+        }
+    }
+    void add(const Bvh_primitive* prims, long begin, long end, const vec3& cmin, const float scale[3], int n_bins)
+    {
+        for (long i = begin; i < end; i++) {
+            for (int a = 0; a < 3; a++) {
+                if (scale[a] <= 0) continue;
+                int b = std::min(n_bins - 1, int(scale[a] * (prims[i].centroid[a] - cmin[a])));
+                counts[a][b]++;
+                boxes[a][b].expand(prims[i].box);
+            }
+        }
+    }
+    void merge(const Bvh_bins& o, int n_bins)
+    {
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < n_bins; b++) {
+                counts[a][b] += o.counts[a][b];
+                boxes[a][b].expand(o.boxes[a][b]);
+            }
+        }
+    }
+    int counts[3][max_bins];
+    Aabb boxes[3][max_bins];
+};
+
+/*
+ * Binned SAH split of prims[0, n) inside bounds. Partitions prims in place and returns the size of
+ * the left part, or 0 when a leaf is cheaper than any split. Large nodes are binned and partitioned
+ * in parallel.
+ */
+int bvh_sah_split(Bvh_primitive* prims, int n, const Aabb& bounds, const Bvh_build_params& params)
+{
+    if (n <= 1) return 0;
+
+    // Small nodes, the vast majority, bin into per-thread scratch space without allocating
+    static thread_local Bvh_bins scratch;
+    int n_chunks = n >= bvh_parallel_threshold ? build_threads(params) : 1;
+    std::vector<Bvh_bins> chunk_bins(n_chunks > 1 ? n_chunks : 0);
+    Aabb cb = centroid_bounds(prims, n, n_chunks);
+    vec3 cmin = cb._min;
+    vec3 cmax = cb._max;
+
+    int n_bins = std::max(2, std::min(params.n_bins, int(Bvh_bins::max_bins)));
+    float scale[3];
+    for (int a = 0; a < 3; a++) scale[a] = cmax[a] > cmin[a] ? n_bins / (cmax[a] - cmin[a]) : 0;
+
+    parallel_chunks(n, n_chunks, [&](int chunk, long begin, long end) {
+        Bvh_bins& b = n_chunks > 1 ? chunk_bins[chunk] : scratch;
+        b.clear(n_bins);
+        b.add(prims, begin, end, cmin, scale, n_bins);
+    });
+    Bvh_bins& bins = n_chunks > 1 ? chunk_bins[0] : scratch;
+    for (int c = 1; c < n_chunks; c++) bins.merge(chunk_bins[c], n_bins);
+
+    float right_area[Bvh_bins::max_bins];
+    int right_count[Bvh_bins::max_bins];
+    float parent_area = bounds.area();
+    float best_cost = FLT_MAX;
+    int best_axis = -1;
+    int best_bin = 0;
+    for (int a = 0; a < 3; a++) {
+        if (scale[a] <= 0) continue;
+        const int* counts = bins.counts[a];
+        const Aabb* boxes = bins.boxes[a];
+
+        // Sweep from the right to get the cost of every right part, then from the left
+        Aabb acc = empty_box();
+        int count = 0;
+        for (int b = n_bins - 1; b > 0; b--) {
+            acc.expand(boxes[b]);
+            count += counts[b];
+            right_area[b] = acc.area();
+            right_count[b] = count;
+        }
+        acc = empty_box();
+        count = 0;
+        for (int b = 0; b < n_bins - 1; b++) {
+            acc.expand(boxes[b]);
+            count += counts[b];
+            if (count == 0 || right_count[b + 1] == 0) continue;
+            float cost = acc.area() * count + right_area[b + 1] * right_count[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_bin = b;
+            }
+        }
+    }
+
+    if (best_axis < 0) {
+        // Every centroid coincides: only a count split can still shrink the node
+        if (n <= params.max_leaf_size) return 0;
+        return n / 2;
+    }
+
+    best_cost = params.traversal_cost + params.intersection_cost * best_cost / ffmax(parent_area, FLT_MIN);
+    float leaf_cost = params.intersection_cost * n;
+    if (n <= params.max_leaf_size && leaf_cost <= best_cost) return 0;
+
+    float axis_scale = scale[best_axis];
+    float origin = cmin[best_axis];
+    auto goes_left = [=](const Bvh_primitive& p) { return std::min(n_bins - 1, int(axis_scale * (p.centroid[best_axis] - origin))) <= best_bin; };
+    int n_left;
+    if (n_chunks > 1)
+        n_left = int(parallel_partition(prims, n, n_chunks, goes_left));
+    else
+        n_left = int(std::partition(prims, prims + n, goes_left) - prims);
+    if (n_left == 0 || n_left == n) return n / 2;
+    return n_left;
+}
+
+void print_bvh_stats(std::ostream& os, const Bvh_build_stats& stats)
+{
+    os << "---BVH--- : " << stats.n_builds << " builds, " << stats.n_primitives << " primitives, " << stats.n_nodes << " nodes, " << stats.n_leaves
+       << " leaves, SAH cost " << stats.sah_cost << std::endl;
+    os << "---BVH BUILD TIME--- : " << stats.build_time << "s";
+    if (stats.build_time > 0) os << " (" << stats.n_primitives / stats.build_time / 1e6 << " Mprims/s)";
+    os << std::endl;
+}
+
+#endif  // BVHBUILDH
@@ -1,97 +1,130 @@
 #ifndef BVHNODEH
 #define BVHNODEH
 
+#include <chrono>
+#include <vector>
+
 #include "aabb.h"
+#include "bvh_build.h"
 #include "hitable.h"
+#include "hitablelist.h"
+#include "render_stats.h"
 
 class Bvh_node : public Hitable
 {
   public:
-    Bvh_node();
-    Bvh_node(Hitable** l, int n, float time0, float time1);
+    Bvh_node() {}
+    Bvh_node(Hitable** l, int n, float time0, float time1, const Bvh_build_params& params = Bvh_build_params());
     virtual bool hit(const Ray& r, float tmin, float tmax, Hit_record& rec) const;
     bool bounding_box(float t0, float t1, Aabb& box) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const
+    {
+        STAT_INC(STAT_BVH_NODES);
+        if (!box.hit(r, t_min, t_max)) return false;
+        return left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max));
+    }
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        left->collect_lights(lights);
+        if (right != left) right->collect_lights(lights);
+    }
     Hitable* left;
-    Hitable* right;
+    Hitable* right;  // equal to left for leaves
     Aabb box;
+    float cost;  // SAH cost of the subtree
+
+  private:
+    void build(Hitable** l, Bvh_primitive* prims, int n, const Bvh_build_params& params, int depth);
+    Hitable* build_child(Hitable** l, Bvh_primitive* prims, int n, const Bvh_build_params& params, int depth, float& child_cost, Aabb& child_box);
 };
 
-int box_x_compare(const void* a, const void* b)
-{
-    Aabb box_left, box_right;
-    Hitable* ah = *(Hitable**)a;
-    Hitable* bh = *(Hitable**)b;
-    if (!ah->bounding_box(0, 0, box_left) || !bh->bounding_box(0, 0, box_right)) std::cerr << "no bounding box in bvh_node constructor\n";
-    if (box_left.min().x() - box_right.min().x() < 0.0)
-        return -1;
-    else
-        return 1;
-}
-int box_y_compare(const void* a, const void* b)
+Bvh_node::Bvh_node(Hitable** l, int n, float time0, float time1, const Bvh_build_params& params)
 {
-    Aabb box_left, box_right;
-    Hitable* ah = *(Hitable**)a;
-    Hitable* bh = *(Hitable**)b;
-    if (!ah->bounding_box(0, 0, box_left) || !bh->bounding_box(0, 0, box_right)) std::cerr << "no bounding box in bvh_node constructor\n";
-    if (box_left.min().y() - box_right.min().y() < 0.0)
-        return -1;
-    else
-        return 1;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+    std::vector<Bvh_primitive> prims;
+    compute_primitive_bounds(l, n, time0, time1, params, prims);
+    build(l, &prims[0], n, params, 0);
+    if (params.stats) {
+        params.stats->n_builds++;
+        params.stats->n_primitives += n;
+        params.stats->sah_cost += cost;
+        params.stats->build_time += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    }
 }
-int box_z_compare(const void* a, const void* b)
+
+/*
+ * Single primitives hang directly off their parent instead of getting a leaf node of their own
+ */
+Hitable* Bvh_node::build_child(Hitable** l, Bvh_primitive* prims, int n, const Bvh_build_params& params, int depth, float& child_cost, Aabb& child_box)
 {
-    Aabb box_left, box_right;
-    Hitable* ah = *(Hitable**)a;
-    Hitable* bh = *(Hitable**)b;
-    if (!ah->bounding_box(0, 0, box_left) || !bh->bounding_box(0, 0, box_right)) std::cerr << "no bounding box in bvh_node constructor\n";
-    if (box_left.min().z() - box_right.min().z() < 0.0)
-        return -1;
-    else
-        return 1;
+    if (n == 1) {
+        child_cost = params.intersection_cost;
+        child_box = prims[0].box;
+        if (params.stats) params.stats->n_leaves++;
+        return l[prims[0].index];
+    }
+    Bvh_node* node = new Bvh_node();
+    node->build(l, prims, n, params, depth);
+    child_cost = node->cost;
+    child_box = node->box;
+    return node;
 }
 
-Bvh_node::Bvh_node(Hitable** l, int n, float time0, float time1)
+void Bvh_node::build(Hitable** l, Bvh_primitive* prims, int n, const Bvh_build_params& params, int depth)
 {
-    int axis = int(3 * drand48());
-    if (axis == 0)
-        qsort(l, n, sizeof(Hitable*), box_x_compare);
-    else if (axis == 1)
-        qsort(l, n, sizeof(Hitable*), box_y_compare);
-    else
-        qsort(l, n, sizeof(Hitable*), box_z_compare);
-    if (n == 1) {
-        left = right = l[0];
-    } else if (n == 2) {
-        left = l[0];
-        right = l[1];
-    } else {
-        left = new Bvh_node(l, n / 2, time0, time1);
-        right = new Bvh_node(l + n / 2, n - n / 2, time0, time1);
+    box = prims[0].box;
+    for (int i = 1; i < n; i++) box.expand(prims[i].box);
+    if (params.stats) params.stats->n_nodes++;
+
+    int n_left = params.method == BVH_SPLIT_SAH ? bvh_sah_split(prims, n, box, params) : bvh_median_split(prims, n, params);
+    if (n_left == 0) {
+        if (n == 1) {
+            left = right = l[prims[0].index];
+        } else {
+            Hitable** leaf = new Hitable*[n];
+            for (int i = 0; i < n; i++) leaf[i] = l[prims[i].index];
+            left = right = new Hitable_list(leaf, n);
+        }
+        cost = params.intersection_cost * n;
+        if (params.stats) params.stats->n_leaves++;
+        return;
     }
+
+    float left_cost, right_cost;
     Aabb box_left, box_right;
-    if (!left->bounding_box(time0, time1, box_left) || !right->bounding_box(time0, time1, box_right))
-        std::cerr << "no bounding box in bvh_node constructor\n";
-    box = surrounding_box(box_left, box_right);
+    if (bvh_fork(n, depth, params)) {
+        // The left subtree goes to the task pool with its own statistics, merged once it is done
+        Bvh_build_stats left_stats;
+        Bvh_build_params left_params = params;
+        left_params.stats = params.stats ? &left_stats : NULL;
+        parallel_invoke([&]() { left = build_child(l, prims, n_left, left_params, depth + 1, left_cost, box_left); },
+                        [&]() { right = build_child(l, prims + n_left, n - n_left, params, depth + 1, right_cost, box_right); });
+        if (params.stats) params.stats->add(left_stats);
+    } else {
+        left = build_child(l, prims, n_left, params, depth + 1, left_cost, box_left);
+        right = build_child(l, prims + n_left, n - n_left, params, depth + 1, right_cost, box_right);
+    }
+
+    float area = box.area();
+    if (area > 0)
+        cost = params.traversal_cost + (box_left.area() * left_cost + box_right.area() * right_cost) / area;
+    else
+        cost = params.traversal_cost + left_cost + right_cost;
 }
 
 bool Bvh_node::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
 {
+    STAT_INC(STAT_BVH_NODES);
     if (box.hit(r, t_min, t_max)) {
         Hit_record left_rec, right_rec;
         bool hit_left = left->hit(r, t_min, t_max, left_rec);
-        bool hit_right = right->hit(r, t_min, t_max, right_rec);
-        if (hit_left && hit_right) {
-            if (left_rec.t < right_rec.t)
-                rec = left_rec;
-            else
-                rec = right_rec;
+        bool hit_right = right != left && right->hit(r, t_min, hit_left ? left_rec.t : t_max, right_rec);
+        if (hit_right) {
+            rec = right_rec;
             return true;
         } else if (hit_left) {
             rec = left_rec;
             return true;
-        } else if (hit_right) {
-            rec = right_rec;
-            return true;
         } else
             return false;
     } else
@@ -1,13 +1,14 @@
 #ifndef CAMERAH
 #define CAMERAH
 
+#include "random.h"
 #include "ray.h"
 
 vec3 random_in_unit_disk()
 {
     vec3 p;
     do {
-        p = 2.0 * vec3(drand48(), drand48(), 0) - vec3(1, 1, 0);
+        p = 2.0 * vec3(random_float(), random_float(), 0) - vec3(1, 1, 0);
     } while (dot(p, p) >= 1.0);
     return p;
 }
@@ -36,7 +37,7 @@ class Camera
     {
         vec3 rd = lens_radius * random_in_unit_disk();
         vec3 offset = u * rd.x() + v * rd.y();
-        float time = time0 + drand48() * (time1 - time0);
+        float time = time0 + random_float() * (time1 - time0);
 
         return Ray(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset, time);
     }
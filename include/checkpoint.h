@@ -0,0 +1,62 @@
+#ifndef CHECKPOINTH
+#define CHECKPOINTH
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "framebuffer.h"
+#include "scene_cache.h"
+
+/*
+ * Render checkpoints: the framebuffer's per-pixel sums and sample counts, the adaptive sampler's
+ * active pixels and where the pass loop stands, stored as a cache file keyed by a hash of every
+ * setting that changes the image. Pixel samples are seeded from the base seed, the pixel and the
+ * sample index alone, so the counts are all the generator state there is: a resumed render draws
+ * exactly the samples the uninterrupted one would have, in the same order.
+ */
+
+struct Render_progress {
+    Render_progress() : n_passes(0), budget(0), pass_begin(0), pass_end(0), in_pass(false) {}
+    int n_passes;
+    long budget;     // samples left to spend
+    int pass_begin;  // samples every active pixel had when the current pass started
+    int pass_end;    // and will have once it is done
+    bool in_pass;    // stopped inside the pass, which resumes with the same active pixels
+};
+
+bool write_checkpoint(const std::string& file, uint64_t key, const Framebuffer& film, const std::vector<unsigned char>& active,
+                      const Render_progress& progress)
+{
+    uint64_t counts[6] = { film.pixels.size(), uint64_t(progress.n_passes), uint64_t(int64_t(progress.budget)), uint64_t(progress.pass_begin),
+                           uint64_t(progress.pass_end), uint64_t(progress.in_pass) };
+    const void* arrays[2] = { film.pixels.data(), active.data() };
+    uint64_t sizes[2] = { sizeof(Pixel_stats) * film.pixels.size(), active.size() };
+    return write_cache(file, CACHE_CHECKPOINT, key, counts, arrays, sizes, 2);
+}
+
+/*
+ * Restores film, active and progress from file. Returns false, leaving them untouched, if the
+ * checkpoint is missing or was written for other settings.
+ */
+bool read_checkpoint(const std::string& file, uint64_t key, Framebuffer& film, std::vector<unsigned char>& active, Render_progress& progress)
+{
+    Mapped_file map(file.c_str());
+    const Cache_header* h = open_cache(map, CACHE_CHECKPOINT, key);
+    if (!h || h->counts[0] != film.pixels.size() || active.size() != film.pixels.size()) return false;
+    uint64_t pixels_offset = cache_align(sizeof(Cache_header));
+    uint64_t pixels_size = sizeof(Pixel_stats) * film.pixels.size();
+    uint64_t active_offset = cache_align(pixels_offset + pixels_size);
+    if (active_offset + active.size() > map.size) return false;
+
+    memcpy(film.pixels.data(), map.data + pixels_offset, pixels_size);
+    memcpy(active.data(), map.data + active_offset, active.size());
+    progress.n_passes = int(h->counts[1]);
+    progress.budget = long(int64_t(h->counts[2]));
+    progress.pass_begin = int(h->counts[3]);
+    progress.pass_end = int(h->counts[4]);
+    progress.in_pass = h->counts[5] != 0;
+    return true;
+}
+
+#endif  // CHECKPOINTH
@@ -3,6 +3,7 @@
 
 #include "hitable.h"
 #include "material.h"
+#include "render_stats.h"
 
 class Constant_medium : public Hitable
 {
@@ -17,26 +18,24 @@ class Constant_medium : public Hitable
 
 bool Constant_medium::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
 {
-    bool db = (drand48() < 0.00001);
-    db = false;
+    STAT_INC(STAT_MEDIUM_QUERIES);
+    STAT_INC(STAT_MEDIUM_BOUNDARY_QUERIES);
     Hit_record rec1, rec2;
     if (boundary->hit(r, -FLT_MAX, FLT_MAX, rec1)) {
+        STAT_INC(STAT_MEDIUM_BOUNDARY_QUERIES);
         if (boundary->hit(r, rec1.t + 0.0001, FLT_MAX, rec2)) {
-            if (db) std::cerr << "\nt0 t1 " << rec1.t << " " << rec2.t << "\n";
             if (rec1.t < t_min) rec1.t = t_min;
             if (rec2.t > t_max) rec2.t = t_max;
             if (rec1.t >= rec2.t) return false;
             if (rec1.t < 0) rec1.t = 0;
             float distance_inside_boundary = (rec2.t - rec1.t) * r.direction().length();
-            float hit_distance = -(1 / density) * log(drand48());
+            float hit_distance = -(1 / density) * log(random_float());
             if (hit_distance < distance_inside_boundary) {
-                if (db) std::cerr << "hit_distance = " << hit_distance << "\n";
                 rec.t = rec1.t + hit_distance / r.direction().length();
-                if (db) std::cerr << "rec.t = " << rec.t << "\n";
                 rec.p = r.point_at_parameter(rec.t);
-                if (db) std::cerr << "rec.p = " << rec.p << "\n";
                 rec.normal = vec3(1, 0, 0);  // arbitrary
                 rec.mat_ptr = phase_function;
+                rec.hitable = NULL;
                 return true;
             }
         }
@@ -0,0 +1,199 @@
+#ifndef FRAMEBUFFERH
+#define FRAMEBUFFERH
+
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "image_io.h"
+#include "vec3.h"
+
+inline float luminance(const vec3& c) { return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2]; }
+
+/*
+ * Running sums of one pixel's samples: color, and display luminance (clamped, gamma 2) with its square
+ * for the variance
+ */
+struct Pixel_stats {
+    Pixel_stats() : n(0), sum_y(0), sum_y2(0) { sum[0] = sum[1] = sum[2] = 0; }
+    int n;
+    double sum[3];
+    double sum_y;
+    double sum_y2;
+};
+
+/*
+ * Adaptive sampling: pixels get min_spp samples, then further passes go to the pixels whose relative
+ * error is still above target_error, until they reach max_spp or the frame's sample budget is spent.
+ * A budget too small for a full pass goes to the noisiest pixels.
+ */
+struct Adaptive_params {
+    Adaptive_params() : target_error(0), min_spp(16), max_spp(0) {}
+    float target_error;  // 0: every pixel gets the same samples
+    int min_spp;
+    int max_spp;  // 0: eight times the average
+};
+
+// Pixels whose display luminance is below this are held to an absolute rather than relative error
+const double adaptive_dark_luminance = 0.1;
+
+/**************************************************************************************************************/
+/*
+ * Class Framebuffer
+ *
+ * Float accumulation buffer in render coordinates (row 0 at the bottom). Tiles are disjoint, so the
+ * render threads add samples to their own pixels without locking.
+ */
+class Framebuffer
+{
+  public:
+    Framebuffer(int w, int h) : nx(w), ny(h), pixels(size_t(w) * h) {}
+    Pixel_stats& at(int i, int j) { return pixels[size_t(j) * nx + i]; }
+    const Pixel_stats& at(int i, int j) const { return pixels[size_t(j) * nx + i]; }
+    void add_sample(int i, int j, const vec3& c);
+    vec3 mean(int i, int j) const;
+    float relative_error(int i, int j) const;
+    float window_error(int i, int j) const;
+    long total_samples() const;
+    long unsampled_pixels() const;
+    void resolve(Image& image) const;
+    int nx, ny;
+    std::vector<Pixel_stats> pixels;
+};
+
+void Framebuffer::add_sample(int i, int j, const vec3& c)
+{
+    Pixel_stats& p = at(i, j);
+    for (int k = 0; k < 3; k++) p.sum[k] += c[k];
+    double y = sqrt(std::min(std::max(double(luminance(c)), 0.0), 1.0));
+    p.sum_y += y;
+    p.sum_y2 += y * y;
+    p.n++;
+}
+
+vec3 Framebuffer::mean(int i, int j) const
+{
+    const Pixel_stats& p = at(i, j);
+    if (p.n == 0) return vec3(0, 0, 0);
+    return vec3(p.sum[0] / p.n, p.sum[1] / p.n, p.sum[2] / p.n);
+}
+
+/*
+ * Standard error of the pixel's mean luminance over that mean; FLT_MAX below two samples
+ */
+float Framebuffer::relative_error(int i, int j) const
+{
+    const Pixel_stats& p = at(i, j);
+    if (p.n < 2) return FLT_MAX;
+    double mean_y = p.sum_y / p.n;
+    double variance = std::max(0.0, (p.sum_y2 - p.sum_y * mean_y) / (p.n - 1));
+    return float(sqrt(variance / p.n) / std::max(mean_y, adaptive_dark_luminance));
+}
+
+/*
+ * Mean relative error over the 3x3 window around the pixel. A few samples can all miss a rare bright
+ * path, so a single pixel's estimate is too noisy to stop on.
+ */
+float Framebuffer::window_error(int i, int j) const
+{
+    float sum = 0;
+    int n = 0;
+    for (int y = std::max(j - 1, 0); y <= std::min(j + 1, ny - 1); y++) {
+        for (int x = std::max(i - 1, 0); x <= std::min(i + 1, nx - 1); x++) {
+            float e = relative_error(x, y);
+            if (e == FLT_MAX) return FLT_MAX;
+            sum += e;
+            n++;
+        }
+    }
+    return sum / n;
+}
+
+long Framebuffer::total_samples() const
+{
+    long n = 0;
+    for (size_t k = 0; k < pixels.size(); k++) n += pixels[k].n;
+    return n;
+}
+
+long Framebuffer::unsampled_pixels() const
+{
+    long n = 0;
+    for (size_t k = 0; k < pixels.size(); k++) n += pixels[k].n == 0;
+    return n;
+}
+
+/*
+ * Pixel means into image, flipped to its top-to-bottom rows
+ */
+void Framebuffer::resolve(Image& image) const
+{
+    for (int j = 0; j < ny; j++) {
+        for (int i = 0; i < nx; i++) {
+            vec3 c = mean(i, j);
+            float* pixel = image.pixel(i, ny - 1 - j);
+            for (int k = 0; k < 3; k++) pixel[k] = c[k];
+        }
+    }
+}
+
+/*
+ * Clears the active flag of pixels that reached max_spp or, past min_spp, the target error. Returns
+ * the number of pixels still active.
+ */
+long retire_converged(const Framebuffer& film, const Adaptive_params& params, int max_spp, std::vector<unsigned char>& active)
+{
+    long n_active = 0;
+    for (int j = 0; j < film.ny; j++) {
+        for (int i = 0; i < film.nx; i++) {
+            unsigned char& a = active[size_t(j) * film.nx + i];
+            if (!a) continue;
+            int n = film.at(i, j).n;
+            if (n >= max_spp || (params.target_error > 0 && n >= params.min_spp && film.window_error(i, j) <= params.target_error))
+                a = 0;
+            else
+                n_active++;
+        }
+    }
+    return n_active;
+}
+
+/*
+ * Keeps only the n_keep active pixels with the largest relative error, for when the remaining budget
+ * cannot cover a pass over all of them. Returns the number of pixels still active.
+ */
+long keep_noisiest(const Framebuffer& film, long n_keep, std::vector<unsigned char>& active)
+{
+    std::vector<float> errors;
+    for (int j = 0; j < film.ny; j++)
+        for (int i = 0; i < film.nx; i++)
+            if (active[size_t(j) * film.nx + i]) errors.push_back(film.window_error(i, j));
+    if (n_keep >= long(errors.size())) return long(errors.size());
+    if (n_keep <= 0) {
+        std::fill(active.begin(), active.end(), 0);
+        return 0;
+    }
+    std::nth_element(errors.begin(), errors.end() - n_keep, errors.end());
+    float threshold = *(errors.end() - n_keep);
+
+    // Ties at the threshold are kept while there is room
+    long n_above = 0;
+    for (size_t k = 0; k < errors.size(); k++) n_above += errors[k] > threshold;
+    long n_ties = n_keep - n_above;
+    long n_active = 0;
+    for (int j = 0; j < film.ny; j++) {
+        for (int i = 0; i < film.nx; i++) {
+            unsigned char& a = active[size_t(j) * film.nx + i];
+            if (!a) continue;
+            float e = film.window_error(i, j);
+            if (e > threshold || (e == threshold && n_ties-- > 0))
+                n_active++;
+            else
+                a = 0;
+        }
+    }
+    return n_active;
+}
+
+#endif  // FRAMEBUFFERH
@@ -0,0 +1,86 @@
+#ifndef HEATMAPH
+#define HEATMAPH
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "image_io.h"
+#include "vec3.h"
+
+enum Heatmap_metric {
+    HEATMAP_NONE,
+    HEATMAP_TIME,  // seconds spent sampling the pixel
+    HEATMAP_RAYS,  // rays traced for it
+    HEATMAP_WORK   // BVH nodes visited and primitives tested, in -DRENDER_STATS builds
+};
+
+/*
+ * False colour of x in [0, 1]: black through purple, red and orange to pale yellow (an approximation
+ * of the inferno map), which stays ordered when printed in grey
+ */
+inline vec3 heat_color(float x)
+{
+    static const float stops[5][3] = { { 0.0f, 0.0f, 0.02f }, { 0.34f, 0.06f, 0.43f }, { 0.74f, 0.22f, 0.33f }, { 0.98f, 0.56f, 0.04f }, { 0.99f, 1.0f, 0.64f } };
+    x = std::min(std::max(x, 0.0f), 1.0f) * 4;
+    int k = std::min(int(x), 3);
+    float f = x - k;
+    return vec3(stops[k][0] + f * (stops[k + 1][0] - stops[k][0]), stops[k][1] + f * (stops[k + 1][1] - stops[k][1]),
+                stops[k][2] + f * (stops[k + 1][2] - stops[k][2]));
+}
+
+/**************************************************************************************************************/
+/*
+ * Class Cost_map
+ *
+ * Per-pixel cost of a render in render coordinates (row 0 at the bottom), summed over the passes.
+ * Like the framebuffer, each pixel is only ever touched by the thread rendering its tile.
+ */
+class Cost_map
+{
+  public:
+    Cost_map(int w, int h) : nx(w), ny(h), cost(size_t(w) * h, 0.0) {}
+    void add(int i, int j, double c) { cost[size_t(j) * nx + i] += c; }
+    double percentile(double p) const;
+    bool write(const std::string& stem, double& scale) const;
+    int nx, ny;
+    std::vector<double> cost;
+};
+
+double Cost_map::percentile(double p) const
+{
+    if (cost.empty()) return 0;
+    std::vector<double> sorted(cost);
+    size_t k = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+    return sorted[k];
+}
+
+/*
+ * Writes the costs as stem.cost.pfm, the raw values in all three channels, and stem.cost.png in false
+ * colour, where the 99th percentile, returned in scale, and anything above is the brightest colour
+ * so a few outliers do not flatten the rest
+ */
+bool Cost_map::write(const std::string& stem, double& scale) const
+{
+    scale = percentile(0.99);
+    if (!(scale > 0)) scale = *std::max_element(cost.begin(), cost.end());
+    if (!(scale > 0)) scale = 1;
+    std::vector<float> raw(3 * cost.size());
+    std::vector<unsigned char> bytes(3 * cost.size());
+    for (int j = 0; j < ny; j++) {
+        for (int i = 0; i < nx; i++) {
+            size_t src = size_t(j) * nx + i;
+            size_t dst = 3 * (size_t(ny - 1 - j) * nx + i);
+            vec3 c = heat_color(float(cost[src] / scale));
+            for (int k = 0; k < 3; k++) {
+                raw[dst + k] = float(cost[src]);
+                bytes[dst + k] = (unsigned char)int(255.99f * c[k]);
+            }
+        }
+    }
+    bool raw_ok = write_pfm((stem + ".cost.pfm").c_str(), nx, ny, raw.data());
+    return write_ldr((stem + ".cost.png").c_str(), IMAGE_PNG, nx, ny, bytes.data()) && raw_ok;
+}
+
+#endif  // HEATMAPH
@@ -2,10 +2,13 @@
 #define HITABLEH
 
 //#include "material.h"
+#include <vector>
+
 #include "aabb.h"
 #include "ray.h"
 
 class Material;
+class Hitable;
 
 void get_sphere_uv(const vec3& p, float& u, float& v)
 {
@@ -16,12 +19,18 @@ void get_sphere_uv(const vec3& p, float& u, float& v)
 }
 
 struct Hit_record {
+    Hit_record() : hitable(NULL) {}
     float t;
     float u;
     float v;
     vec3 p;
     vec3 normal;
     Material* mat_ptr;
+    // Primitive that still has to fill p, normal, u, v and mat_ptr in finalize(), NULL once they are
+    // set. Until then u and v hold its local coordinates (barycentrics for triangles) and prim_id the
+    // part of it that was hit.
+    const Hitable* hitable;
+    int prim_id;
 };
 
 /**************************************************************************************************************/
@@ -31,13 +40,43 @@ struct Hit_record {
 class Hitable
 {
   public:
+    virtual ~Hitable() {}
     virtual bool hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const = 0;
     virtual bool bounding_box(float t0, float t1, Aabb& box) const = 0;
+    // Shading data of a hit that hit() deferred to rec.hitable == this; r is the ray hit() was given
+    virtual void finalize(const Ray& r, Hit_record& rec) const {}
+    // Any-hit query for shadow rays: whether something lies in (t_min, t_max), without shading data
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const
+    {
+        Hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+    // Light sampling: solid-angle density of direction v seen from o, and a direction from o toward a
+    // random point of the surface
+    virtual float pdf_value(const vec3& o, const vec3& v) const { return 0; }
+    virtual vec3 random(const vec3& o) const { return vec3(1, 0, 0); }
+    // Appends the emitting surfaces that can be sampled, wrapped like this object
+    virtual void collect_lights(std::vector<Hitable*>& lights) {}
 };
 
+/*
+ * hit() only records t and what was hit, so that candidates superseded by a closer hit cost no
+ * shading work. The closest hit is completed here, against the same ray.
+ */
+inline void finalize_hit(const Ray& r, Hit_record& rec)
+{
+    if (rec.hitable) {
+        const Hitable* h = rec.hitable;
+        rec.hitable = NULL;
+        h->finalize(r, rec);
+    }
+}
+
 /**************************************************************************************************************/
 /*
  * Class Flip_normals
+ *
+ * Wrappers finalize their child's hit before changing it, since only they know the child's ray
  */
 class Flip_normals : public Hitable
 {
@@ -46,12 +85,22 @@ class Flip_normals : public Hitable
     virtual bool hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
     {
         if (ptr->hit(r, t_min, t_max, rec)) {
+            finalize_hit(r, rec);
             rec.normal = -rec.normal;
             return true;
         } else
             return false;
     }
     virtual bool bounding_box(float t0, float t1, Aabb& box) const { return ptr->bounding_box(t0, t1, box); }
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const { return ptr->occluded(r, t_min, t_max); }
+    virtual float pdf_value(const vec3& o, const vec3& v) const { return ptr->pdf_value(o, v); }
+    virtual vec3 random(const vec3& o) const { return ptr->random(o); }
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        std::vector<Hitable*> inner;
+        ptr->collect_lights(inner);
+        for (size_t i = 0; i < inner.size(); i++) lights.push_back(inner[i] == ptr ? this : new Flip_normals(inner[i]));
+    }
     Hitable* ptr;
 };
 
@@ -65,6 +114,18 @@ class Translate : public Hitable
     Translate(Hitable* p, const vec3& displacement) : ptr(p), offset(displacement) {}
     virtual bool hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const;
     virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const
+    {
+        return ptr->occluded(Ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+    }
+    virtual float pdf_value(const vec3& o, const vec3& v) const { return ptr->pdf_value(o - offset, v); }
+    virtual vec3 random(const vec3& o) const { return ptr->random(o - offset); }
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        std::vector<Hitable*> inner;
+        ptr->collect_lights(inner);
+        for (size_t i = 0; i < inner.size(); i++) lights.push_back(inner[i] == ptr ? this : new Translate(inner[i], offset));
+    }
     vec3 offset;
     Hitable* ptr;
 };
@@ -73,6 +134,7 @@ bool Translate::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) con
 {
     Ray moved_r(r.origin() - offset, r.direction(), r.time());
     if (ptr->hit(moved_r, t_min, t_max, rec)) {
+        finalize_hit(moved_r, rec);
         rec.p += offset;
         return true;
     } else
@@ -101,13 +163,28 @@ class Rotate_y : public Hitable
         box = bbox;
         return hasbox;
     }
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const
+    {
+        return ptr->occluded(Ray(to_object(r.origin()), to_object(r.direction()), r.time()), t_min, t_max);
+    }
+    virtual float pdf_value(const vec3& o, const vec3& v) const { return ptr->pdf_value(to_object(o), to_object(v)); }
+    virtual vec3 random(const vec3& o) const { return to_world(ptr->random(to_object(o))); }
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        std::vector<Hitable*> inner;
+        ptr->collect_lights(inner);
+        for (size_t i = 0; i < inner.size(); i++) lights.push_back(inner[i] == ptr ? this : new Rotate_y(inner[i], angle));
+    }
+    vec3 to_object(const vec3& a) const { return vec3(cos_theta * a[0] - sin_theta * a[2], a[1], sin_theta * a[0] + cos_theta * a[2]); }
+    vec3 to_world(const vec3& a) const { return vec3(cos_theta * a[0] + sin_theta * a[2], a[1], -sin_theta * a[0] + cos_theta * a[2]); }
     Hitable* ptr;
+    float angle;
     float sin_theta;
     float cos_theta;
     bool hasbox;
     Aabb bbox;
 };
-Rotate_y::Rotate_y(Hitable* p, float angle) : ptr(p)
+Rotate_y::Rotate_y(Hitable* p, float degrees) : ptr(p), angle(degrees)
 {
     float radians = (M_PI / 180.) * angle;
     sin_theta = sin(radians);
@@ -144,6 +221,7 @@ bool Rotate_y::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) cons
     direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
     Ray rotated_r(origin, direction, r.time());
     if (ptr->hit(rotated_r, t_min, t_max, rec)) {
+        finalize_hit(rotated_r, rec);
         vec3 p = rec.p;
         vec3 normal = rec.normal;
         p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
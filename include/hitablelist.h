@@ -2,6 +2,8 @@
 #define HITABLELISTH
 
 #include "hitable.h"
+#include "random.h"
+#include "render_stats.h"
 
 class Hitable_list : public Hitable
 {
@@ -14,6 +16,21 @@ class Hitable_list : public Hitable
     }
     virtual bool hit(const Ray& r, float t_min, float tmax, Hit_record& rec) const;
     bool bounding_box(float t0, float t1, Aabb& box) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const
+    {
+        STAT_INC(STAT_LIST_QUERIES);
+        for (int i = 0; i < list_size; i++) {
+            STAT_INC(STAT_LIST_CHILDREN);
+            if (list[i]->occluded(r, t_min, t_max)) return true;
+        }
+        return false;
+    }
+    virtual float pdf_value(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const;
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        for (int i = 0; i < list_size; i++) list[i]->collect_lights(lights);
+    }
     Hitable** list;
     int list_size;
 };
@@ -38,6 +55,8 @@ bool Hitable_list::bounding_box(float t0, float t1, Aabb& box) const
 
 bool Hitable_list::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
 {
+    STAT_INC(STAT_LIST_QUERIES);
+    STAT_ADD(STAT_LIST_CHILDREN, list_size);
     Hit_record temp_rec;
     bool hit_anything = false;
     double closest_so_far = t_max;
@@ -51,4 +70,21 @@ bool Hitable_list::hit(const Ray& r, float t_min, float t_max, Hit_record& rec)
     return hit_anything;
 }
 
+/*
+ * Sampling a member uniformly, the density is the average of the members' densities
+ */
+float Hitable_list::pdf_value(const vec3& o, const vec3& v) const
+{
+    if (list_size < 1) return 0;
+    float sum = 0;
+    for (int i = 0; i < list_size; i++) sum += list[i]->pdf_value(o, v);
+    return sum / list_size;
+}
+
+vec3 Hitable_list::random(const vec3& o) const
+{
+    int index = int(random_float() * list_size);
+    return list[index < list_size ? index : list_size - 1]->random(o);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,219 @@
+#ifndef IMAGEIOH
+#define IMAGEIOH
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stb_image_write.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define IMAGEIO_SSE2
+#endif
+
+enum Image_format { IMAGE_PPM, IMAGE_PNG, IMAGE_PFM, IMAGE_HDR };
+enum Tone_curve { TONE_CLAMP, TONE_FILMIC };
+enum Transfer_function { TRANSFER_GAMMA2, TRANSFER_SRGB };
+
+/*
+ * Display mapping of linear pixels for 8-bit output: exposure in stops, a tone curve, clamping to
+ * [0, 1] and the transfer function. Float formats are written linear and unscaled.
+ */
+struct Tone_params {
+    Tone_params() : exposure(0), curve(TONE_CLAMP), transfer(TRANSFER_GAMMA2) {}
+    float exposure;
+    Tone_curve curve;
+    Transfer_function transfer;
+};
+
+/*
+ * Linear RGB pixels, three floats per pixel, rows top to bottom
+ */
+struct Image {
+    Image() : nx(0), ny(0) {}
+    Image(int w, int h) : nx(w), ny(h), rgb(3 * size_t(w) * h, 0.0f) {}
+    float* pixel(int i, int j) { return &rgb[3 * (size_t(j) * nx + i)]; }
+    int nx, ny;
+    std::vector<float> rgb;
+};
+
+/*
+ * Format from the file extension: .png, .pfm, .hdr, anything else binary PPM
+ */
+inline Image_format image_format_from_name(const std::string& path)
+{
+    size_t dot = path.rfind('.');
+    const char* ext = dot == std::string::npos ? "" : path.c_str() + dot;
+    if (!strcasecmp(ext, ".png")) return IMAGE_PNG;
+    if (!strcasecmp(ext, ".pfm")) return IMAGE_PFM;
+    if (!strcasecmp(ext, ".hdr")) return IMAGE_HDR;
+    return IMAGE_PPM;
+}
+
+/*
+ * Filmic curve: Narkowicz's fit of the ACES reference rendering transform, which rolls highlights off
+ * toward white instead of clipping them
+ */
+inline float filmic(float x) { return x * (2.51f * x + 0.03f) / (x * (2.43f * x + 0.59f) + 0.14f); }
+
+/*
+ * sRGB encoding to 8 bits, rounded to nearest, through the linear value at which each code starts:
+ * a branch-free binary search over those thresholds is exact and avoids pow per pixel
+ */
+struct Srgb_encoder {
+    Srgb_encoder()
+    {
+        threshold[0] = -FLT_MAX;
+        for (int k = 1; k < 256; k++) {
+            double v = (k - 0.5) / 255.0;
+            threshold[k] = float(v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+        }
+    }
+    unsigned char encode(float x) const
+    {
+        int k = 0;
+        for (int step = 128; step > 0; step >>= 1) k += threshold[k + step] <= x ? step : 0;
+        return (unsigned char)k;
+    }
+    float threshold[256];
+};
+
+/*
+ * 8-bit display values of n linear pixels. The default mapping is the renderer's original: gamma 2,
+ * clamped, truncated as int(255.99 * c).
+ */
+inline void resolve_ldr(const float* rgb, size_t n, unsigned char* out, const Tone_params& tone = Tone_params())
+{
+    static const Srgb_encoder srgb;
+    float scale = exp2f(tone.exposure);
+    bool filmic_curve = tone.curve == TONE_FILMIC;
+    bool gamma2 = tone.transfer == TRANSFER_GAMMA2;
+    size_t count = 3 * n;
+    size_t i = 0;
+#ifdef IMAGEIO_SSE2
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), vscale = _mm_set1_ps(scale);
+    const __m128d quantize = _mm_set1_pd(255.99);
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_mul_ps(_mm_loadu_ps(rgb + i), vscale);
+        if (filmic_curve) {
+            __m128 num = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), x), _mm_set1_ps(0.03f)));
+            __m128 den = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), x), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+            x = _mm_div_ps(num, den);
+        }
+        x = _mm_min_ps(_mm_max_ps(x, zero), one);  // max first: NaN becomes 0
+        if (gamma2) {
+            // Quantized in double like the scalar path, so both give the same bytes
+            __m128 c = _mm_sqrt_ps(x);
+            __m128i lo = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtps_pd(c), quantize));
+            __m128i hi = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(c, c)), quantize));
+            int q[4];
+            _mm_storeu_si128((__m128i*)q, _mm_unpacklo_epi64(lo, hi));
+            for (int k = 0; k < 4; k++) out[i + k] = (unsigned char)q[k];
+        } else {
+            float c[4];
+            _mm_storeu_ps(c, x);
+            for (int k = 0; k < 4; k++) out[i + k] = srgb.encode(c[k]);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        float x = rgb[i] * scale;
+        if (filmic_curve) x = filmic(x);
+        x = x > 0 ? (x < 1 ? x : 1.0f) : 0.0f;
+        out[i] = gamma2 ? (unsigned char)int(255.99 * sqrtf(x)) : srgb.encode(x);
+    }
+}
+
+inline bool write_ppm(const char* path, int nx, int ny, const unsigned char* bytes)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    fprintf(f, "P6\n%d %d\n255\n", nx, ny);
+    size_t size = 3 * size_t(nx) * ny;
+    bool ok = fwrite(bytes, 1, size, f) == size;
+    return fclose(f) == 0 && ok;
+}
+
+/*
+ * Little-endian PFM; the format stores rows bottom to top
+ */
+inline bool write_pfm(const char* path, int nx, int ny, const float* rgb)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    fprintf(f, "PF\n%d %d\n-1.0\n", nx, ny);
+    bool ok = true;
+    for (int j = ny - 1; j >= 0 && ok; j--) ok = fwrite(rgb + 3 * size_t(j) * nx, sizeof(float), 3 * size_t(nx), f) == 3 * size_t(nx);
+    return fclose(f) == 0 && ok;
+}
+
+// 8-bit RGB rows, top to bottom, as PNG or else PPM
+inline bool write_ldr(const char* path, Image_format format, int nx, int ny, const unsigned char* bytes)
+{
+    if (format == IMAGE_PNG) return stbi_write_png(path, nx, ny, 3, bytes, 3 * nx) != 0;
+    return write_ppm(path, nx, ny, bytes);
+}
+
+inline bool write_image(const char* path, Image_format format, const Image& image, const Tone_params& tone = Tone_params())
+{
+    if (format == IMAGE_PFM) return write_pfm(path, image.nx, image.ny, image.rgb.data());
+    if (format == IMAGE_HDR) return stbi_write_hdr(path, image.nx, image.ny, 3, image.rgb.data()) != 0;
+    std::vector<unsigned char> bytes(image.rgb.size());
+    resolve_ldr(image.rgb.data(), size_t(image.nx) * image.ny, bytes.data(), tone);
+    return write_ldr(path, format, image.nx, image.ny, bytes.data());
+}
+
+/**************************************************************************************************************/
+/*
+ * Class Image_writer
+ *
+ * Writes images on a background thread so encoding and I/O overlap the next frame. Each write takes
+ * its own copy of the pixels and waits for the previous one first; wait() reports whether every
+ * write so far succeeded.
+ */
+class Image_writer
+{
+  public:
+    Image_writer(bool background = true, const Tone_params& display = Tone_params()) : async(background), ok(true), tone(display) {}
+    ~Image_writer() { wait(); }
+    void write(const std::string& path, Image_format format, const Image& image)
+    {
+        wait();
+        if (!async) {
+            report(write_image(path.c_str(), format, image, tone), path);
+            return;
+        }
+        pending = image;
+        pending_path = path;
+        task = std::thread([this, format]() { report(write_image(pending_path.c_str(), format, pending, tone), pending_path); });
+    }
+    bool wait()
+    {
+        if (task.joinable()) task.join();
+        return ok;
+    }
+
+  private:
+    void report(bool written, const std::string& path)
+    {
+        if (!written) {
+            std::cerr << "cannot write " << path << "\n";
+            ok = false;
+        }
+    }
+    bool async;
+    bool ok;
+    Tone_params tone;
+    Image pending;
+    std::string pending_path;
+    std::thread task;
+};
+
+#endif  // IMAGEIOH
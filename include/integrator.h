@@ -0,0 +1,98 @@
+#ifndef INTEGRATORH
+#define INTEGRATORH
+
+#include <float.h>
+#include <vector>
+
+#include "hitable.h"
+#include "material.h"
+#include "pdf.h"
+#include "random.h"
+#include "ray.h"
+#include "render_stats.h"
+
+// Shadow rays stop this fraction of their length short of the light, which is part of the scene too
+const float shadow_epsilon = 1e-3f;
+
+struct Integrator_params {
+    Integrator_params() : max_depth(50), rr_min_depth(3) {}
+    int max_depth;     // scattering events along a path
+    int rr_min_depth;  // bounces before Russian roulette may end a path
+};
+
+/*
+ * Radiance arriving along r, gathered iteratively: each bounce multiplies the path throughput by the
+ * sampled material weight. Non-specular vertices combine two strategies with the power heuristic: a
+ * shadow ray toward a direction sampled from the lights (next-event estimation), and the emission
+ * the path itself runs into after sampling the material's pdf. Specular bounces follow the mirrored
+ * or refracted ray and count what they hit in full. From rr_min_depth on, paths survive with
+ * probability equal to their largest throughput component (at most 0.95) and are reweighted
+ * accordingly. lights may be NULL when the scene has none. n_rays counts the rays traced into world,
+ * shadow rays included.
+ */
+vec3 trace_path(Ray r, Hitable* world, const Hitable* lights, const Integrator_params& params, long& n_rays)
+{
+    vec3 radiance(0, 0, 0);
+    vec3 throughput(1, 1, 1);
+    bool specular_bounce = true;  // camera rays count emission in full too
+    vec3 prev_p;
+    float prev_pdf = 0;
+    Hit_record hrec;
+    STAT_INC(STAT_PATHS);
+    for (int depth = 0;; depth++) {
+        n_rays++;
+        STAT_INC(depth == 0 ? STAT_CAMERA_RAYS : STAT_BOUNCE_RAYS);
+        if (!world->hit(r, 0.001, FLT_MAX, hrec)) break;
+        STAT_INC(STAT_PATH_VERTICES);
+        finalize_hit(r, hrec);
+        vec3 emitted = hrec.mat_ptr->emitted(r, hrec, hrec.u, hrec.v, hrec.p);
+        if (emitted.squared_length() > 0) {
+            float weight = 1;
+            if (!specular_bounce && lights) weight = power_heuristic(prev_pdf, Hitable_pdf(lights, prev_p).value(r.direction()));
+            radiance += weight * throughput * emitted;
+        }
+
+        Scatter_record srec;
+        if (depth >= params.max_depth || !hrec.mat_ptr->scatter(r, hrec, srec)) break;
+        if (srec.is_specular) {
+            throughput *= srec.attenuation;
+            specular_bounce = true;
+            r = srec.specular_ray;
+        } else {
+            if (lights) {
+                Hitable_pdf light_pdf(lights, hrec.p);
+                Ray shadow(hrec.p, light_pdf.generate(), r.time());
+                float pdf = light_pdf.value(shadow.direction());
+                float bsdf = hrec.mat_ptr->scattering_pdf(r, hrec, shadow);
+                Hit_record lrec;
+                if (pdf > 0 && bsdf > 0 && lights->hit(shadow, 0.001, FLT_MAX, lrec)) {
+                    n_rays++;
+                    STAT_INC(STAT_SHADOW_RAYS);
+                    if (!world->occluded(shadow, 0.001, lrec.t * (1 - shadow_epsilon))) {
+                        finalize_hit(shadow, lrec);
+                        vec3 light_emitted = lrec.mat_ptr->emitted(shadow, lrec, lrec.u, lrec.v, lrec.p);
+                        float weight = power_heuristic(pdf, srec.pdf_ptr->value(shadow.direction()));
+                        radiance += weight * bsdf / pdf * throughput * srec.attenuation * light_emitted;
+                    }
+                }
+            }
+            Ray scattered(hrec.p, srec.pdf_ptr->generate(), r.time());
+            float pdf = srec.pdf_ptr->value(scattered.direction());
+            if (!(pdf > 0)) break;
+            throughput *= srec.attenuation * hrec.mat_ptr->scattering_pdf(r, hrec, scattered) / pdf;
+            specular_bounce = false;
+            prev_p = hrec.p;
+            prev_pdf = pdf;
+            r = scattered;
+        }
+
+        if (depth + 1 >= params.rr_min_depth) {
+            float survive = ffmin(0.95f, ffmax(throughput.x(), ffmax(throughput.y(), throughput.z())));
+            if (random_float() >= survive) break;
+            throughput /= survive;
+        }
+    }
+    return radiance;
+}
+
+#endif  // INTEGRATORH
@@ -0,0 +1,281 @@
+#ifndef LINEARBVHH
+#define LINEARBVHH
+
+#include <assert.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+#include "bvh_build.h"
+#include "hitable.h"
+#include "render_stats.h"
+
+/*
+ * 32-byte node of a depth-first flattened BVH. The first child of an interior node immediately
+ * follows it, the second one is at second_child_offset.
+ */
+struct Linear_bvh_node {
+    float bmin[3];
+    float bmax[3];
+    union {
+        int primitives_offset;    // leaf
+        int second_child_offset;  // interior
+    };
+    uint16_t n_primitives;  // 0 for interior nodes
+    uint8_t axis;           // split axis of interior nodes
+    uint8_t pad;
+};
+
+static_assert(sizeof(Linear_bvh_node) == 32, "Linear_bvh_node must stay 32 bytes");
+
+/*
+ * Slab test of a flattened node against r, as in Aabb::hit: the cached direction signs select the
+ * near and far planes, so there is no min/max per axis
+ */
+inline bool node_hit(const Linear_bvh_node& node, const Ray& r, float t_min, float t_max)
+{
+    STAT_INC(STAT_BVH_NODES);
+    for (int a = 0; a < 3; a++) {
+        float lo = r.dir_is_neg[a] ? node.bmax[a] : node.bmin[a];
+        float hi = r.dir_is_neg[a] ? node.bmin[a] : node.bmax[a];
+        t_min = ffmax((lo - r.A[a]) * r.inv_dir[a], t_min);
+        t_max = ffmin((hi - r.A[a]) * r.inv_dir[a] * slab_far_scale, t_max);
+    }
+    return t_min <= t_max;
+}
+
+/*
+ * Appends src to nodes, rebasing the child links of its interior nodes
+ */
+inline void append_linear_bvh(std::vector<Linear_bvh_node>& nodes, const std::vector<Linear_bvh_node>& src)
+{
+    int base = int(nodes.size());
+    nodes.insert(nodes.end(), src.begin(), src.end());
+    for (size_t i = base; i < nodes.size(); i++)
+        if (nodes[i].n_primitives == 0) nodes[i].second_child_offset += base;
+}
+
+/*
+ * Appends the subtree over prims[first, first + n) to nodes and returns its SAH cost. On return the
+ * primitives are in leaf order, so a leaf's primitives_offset indexes straight into prims. No node
+ * is deeper than bvh_max_depth.
+ */
+float build_linear_bvh(std::vector<Bvh_primitive>& prims, int first, int n, const Bvh_build_params& params, std::vector<Linear_bvh_node>& nodes,
+                       int depth = 0)
+{
+    Aabb bounds = prims[first].box;
+    for (int i = 1; i < n; i++) bounds.expand(prims[first + i].box);
+
+    int self = int(nodes.size());
+    nodes.push_back(Linear_bvh_node());
+    for (int a = 0; a < 3; a++) {
+        nodes[self].bmin[a] = bounds._min[a];
+        nodes[self].bmax[a] = bounds._max[a];
+    }
+    nodes[self].pad = 0;
+    if (params.stats) params.stats->n_nodes++;
+
+    int n_left;
+    if (params.method == BVH_SPLIT_SAH)
+        n_left = bvh_sah_split(&prims[first], n, bounds, params);
+    else
+        n_left = bvh_median_split(&prims[first], n, params);
+    // A median split from here on reaches single primitives at depth + ceil_log2(n) <= bvh_max_depth
+    if (n_left > 0 && depth + 1 + ceil_log2(std::max(n_left, n - n_left)) > bvh_max_depth) n_left = bvh_median_split(&prims[first], n, params);
+    if (n_left == 0 && n > 0xffff) n_left = n / 2;  // n_primitives is 16 bits
+    if (n_left == 0) {
+        nodes[self].primitives_offset = first;
+        nodes[self].n_primitives = uint16_t(n);
+        nodes[self].axis = 0;
+        if (params.stats) params.stats->n_leaves++;
+        return params.intersection_cost * n;
+    }
+
+    // The split axis is the one along which the two halves are furthest apart
+    Aabb left_box = prims[first].box;
+    for (int i = 1; i < n_left; i++) left_box.expand(prims[first + i].box);
+    Aabb right_box = prims[first + n_left].box;
+    for (int i = n_left + 1; i < n; i++) right_box.expand(prims[first + i].box);
+    int axis = 0;
+    float best = -FLT_MAX;
+    for (int a = 0; a < 3; a++) {
+        float d = (right_box._min[a] + right_box._max[a]) - (left_box._min[a] + left_box._max[a]);
+        if (fabs(d) > best) {
+            best = fabs(d);
+            axis = a;
+        }
+    }
+    // Keep the child with the smaller centroid first so the sign of the ray direction picks the near one
+    if ((right_box._min[axis] + right_box._max[axis]) < (left_box._min[axis] + left_box._max[axis])) {
+        std::rotate(prims.begin() + first, prims.begin() + first + n_left, prims.begin() + first + n);
+        n_left = n - n_left;
+        std::swap(left_box, right_box);
+    }
+
+    nodes[self].n_primitives = 0;
+    nodes[self].axis = uint8_t(axis);
+    float left_cost, right_cost;
+    if (bvh_fork(n, depth, params)) {
+        // Both subtrees are built into their own arrays, the left one on the task pool, then spliced
+        std::vector<Linear_bvh_node> left_nodes, right_nodes;
+        Bvh_build_stats left_stats;
+        Bvh_build_params left_params = params;
+        left_params.stats = params.stats ? &left_stats : NULL;
+        parallel_invoke([&]() { left_cost = build_linear_bvh(prims, first, n_left, left_params, left_nodes, depth + 1); },
+                        [&]() { right_cost = build_linear_bvh(prims, first + n_left, n - n_left, params, right_nodes, depth + 1); });
+        if (params.stats) params.stats->add(left_stats);
+        append_linear_bvh(nodes, left_nodes);
+        nodes[self].second_child_offset = int(nodes.size());
+        append_linear_bvh(nodes, right_nodes);
+    } else {
+        left_cost = build_linear_bvh(prims, first, n_left, params, nodes, depth + 1);
+        nodes[self].second_child_offset = int(nodes.size());
+        right_cost = build_linear_bvh(prims, first + n_left, n - n_left, params, nodes, depth + 1);
+    }
+
+    float area = bounds.area();
+    if (area > 0) return params.traversal_cost + (left_box.area() * left_cost + right_box.area() * right_cost) / area;
+    return params.traversal_cost + left_cost + right_cost;
+}
+
+/*
+ * Stack traversal of a flattened BVH, nearer child first. intersect_leaf(first, count, t_max) tests
+ * the primitives of one leaf, lowers t_max to the closest hit and returns whether it found one.
+ */
+template <typename F>
+bool traverse_linear_bvh(const Linear_bvh_node* nodes, const Ray& r, float t_min, float t_max, const F& intersect_leaf)
+{
+    int stack[bvh_max_depth];  // one entry per interior level above the current node
+    int sp = 0;
+    int current = 0;
+    bool hit_anything = false;
+    while (true) {
+        const Linear_bvh_node& node = nodes[current];
+        if (node_hit(node, r, t_min, t_max)) {
+            if (node.n_primitives > 0) {
+                if (intersect_leaf(node.primitives_offset, int(node.n_primitives), t_max)) hit_anything = true;
+                if (sp == 0) break;
+                current = stack[--sp];
+            } else if (r.dir_is_neg[node.axis]) {
+                assert(sp < bvh_max_depth);
+                stack[sp++] = current + 1;
+                current = node.second_child_offset;
+            } else {
+                assert(sp < bvh_max_depth);
+                stack[sp++] = node.second_child_offset;
+                current = current + 1;
+            }
+        } else {
+            if (sp == 0) break;
+            current = stack[--sp];
+        }
+    }
+    return hit_anything;
+}
+
+/*
+ * Any-hit traversal of a flattened BVH, stopping at the first leaf for which leaf_occluded(first, count)
+ * is true
+ */
+template <typename F>
+bool occluded_linear_bvh(const Linear_bvh_node* nodes, const Ray& r, float t_min, float t_max, const F& leaf_occluded)
+{
+    int stack[bvh_max_depth];  // one entry per interior level above the current node
+    int sp = 0;
+    int current = 0;
+    while (true) {
+        const Linear_bvh_node& node = nodes[current];
+        if (node_hit(node, r, t_min, t_max)) {
+            if (node.n_primitives > 0) {
+                if (leaf_occluded(node.primitives_offset, int(node.n_primitives))) return true;
+                if (sp == 0) break;
+                current = stack[--sp];
+            } else {
+                assert(sp < bvh_max_depth);
+                stack[sp++] = node.second_child_offset;
+                current = current + 1;
+            }
+        } else {
+            if (sp == 0) break;
+            current = stack[--sp];
+        }
+    }
+    return false;
+}
+
+/**************************************************************************************************************/
+/*
+ * Class Linear_bvh
+ *
+ * BVH over Hitable pointers stored as one contiguous array of nodes, traversed with an explicit stack,
+ * nearer child first, shrinking t_max as hits are found.
+ */
+class Linear_bvh : public Hitable
+{
+  public:
+    Linear_bvh(Hitable** l, int n, float time0, float time1, const Bvh_build_params& params = Bvh_build_params());
+    virtual bool hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const;
+    virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const;
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        for (size_t i = 0; i < primitives.size(); i++) primitives[i]->collect_lights(lights);
+    }
+    std::vector<Linear_bvh_node> nodes;
+    std::vector<Hitable*> primitives;
+};
+
+Linear_bvh::Linear_bvh(Hitable** l, int n, float time0, float time1, const Bvh_build_params& params)
+{
+    if (n == 0) return;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+    std::vector<Bvh_primitive> prims;
+    compute_primitive_bounds(l, n, time0, time1, params, prims);
+    nodes.reserve(2 * n);
+    float cost = build_linear_bvh(prims, 0, n, params, nodes);
+    primitives.resize(n);
+    for (int i = 0; i < n; i++) primitives[i] = l[prims[i].index];
+    if (params.stats) {
+        params.stats->n_builds++;
+        params.stats->n_primitives += n;
+        params.stats->sah_cost += cost;
+        params.stats->build_time += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+}
+
+bool Linear_bvh::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
+{
+    if (nodes.empty()) return false;
+    Hitable* const* prims = &primitives[0];
+    return traverse_linear_bvh(&nodes[0], r, t_min, t_max, [&](int first, int count, float& t_closest) {
+        bool hit_leaf = false;
+        for (int i = 0; i < count; i++) {
+            if (prims[first + i]->hit(r, t_min, t_closest, rec)) {
+                hit_leaf = true;
+                t_closest = rec.t;
+            }
+        }
+        return hit_leaf;
+    });
+}
+
+bool Linear_bvh::occluded(const Ray& r, float t_min, float t_max) const
+{
+    if (nodes.empty()) return false;
+    Hitable* const* prims = &primitives[0];
+    return occluded_linear_bvh(&nodes[0], r, t_min, t_max, [&](int first, int count) {
+        for (int i = 0; i < count; i++)
+            if (prims[first + i]->occluded(r, t_min, t_max)) return true;
+        return false;
+    });
+}
+
+bool Linear_bvh::bounding_box(float t0, float t1, Aabb& box) const
+{
+    if (nodes.empty()) return false;
+    const Linear_bvh_node& root = nodes[0];
+    box = Aabb(vec3(root.bmin[0], root.bmin[1], root.bmin[2]), vec3(root.bmax[0], root.bmax[1], root.bmax[2]));
+    return true;
+}
+
+#endif  // LINEARBVHH
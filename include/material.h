@@ -5,6 +5,8 @@ struct Hit_record;
 
 #include "hitable.h"
 #include "onb.h"
+#include "pdf.h"
+#include "random.h"
 #include "ray.h"
 #include "texture.h"
 
@@ -19,22 +21,11 @@ vec3 random_in_unit_sphere()
 {
     vec3 p;
     do {
-        p = 2.0 * vec3(drand48(), drand48(), drand48()) - vec3(1, 1, 1);
+        p = 2.0 * vec3(random_float(), random_float(), random_float()) - vec3(1, 1, 1);
     } while (p.squared_length() >= 1.0);
     return p;
 }
 
-vec3 random_cosine_direction()
-{
-    float r1 = drand48();
-    float r2 = drand48();
-    float z = sqrt(1 - r2);
-    float phi = 2 * M_PI * r1;
-    float x = cos(phi) * 2 * sqrt(r2);
-    float y = sin(phi) * 2 * sqrt(r2);
-    return vec3(x, y, z);
-}
-
 vec3 reflect(const vec3& v, const vec3& n) { return v - 2 * dot(v, n) * n; }
 bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& refracted)
 {
@@ -47,12 +38,26 @@ bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& refracted)
     } else
         return false;
 }
+/*
+ * Outcome of a scattering event. Specular materials give the scattered ray itself, the others the
+ * pdf their directions should be sampled from (which may point into this record, so it is not
+ * copied around).
+ */
+struct Scatter_record {
+    Ray specular_ray;
+    bool is_specular;
+    vec3 attenuation;
+    Cosine_pdf cosine_pdf;
+    const Pdf* pdf_ptr;
+};
+
 class Material
 {
   public:
-    virtual bool scatter(const Ray& r_in, const Hit_record& rec, vec3& albedo, Ray& scattered, float& pdf) const { return false; };
-    virtual float scattering_pdf(const Ray& r_in, const Hit_record& rec, const Ray& scattered) const { return false; }
+    virtual bool scatter(const Ray& r_in, const Hit_record& rec, Scatter_record& srec) const { return false; };
+    virtual float scattering_pdf(const Ray& r_in, const Hit_record& rec, const Ray& scattered) const { return 0; }
     virtual vec3 emitted(const Ray& r_in, const Hit_record rec, float u, float v, const vec3& p) const { return vec3(0, 0, 0); }
+    virtual bool is_emitter() const { return false; }
 };
 
 class Lambertian : public Material
@@ -66,32 +71,12 @@ class Lambertian : public Material
         return cosine / M_PI;
     }
 
-    virtual bool scatter(const Ray& r_in, const Hit_record& rec, vec3& alb, Ray& scattered, float& pdf) const
+    virtual bool scatter(const Ray& r_in, const Hit_record& rec, Scatter_record& srec) const
     {
-        // // Old version
-        // vec3 target = rec.p + rec.normal + random_in_unit_sphere();
-        // scattered = Ray(rec.p, unit_vector(target - rec.p), r_in.time());
-        // alb = albedo->value(rec.u, rec.v, rec.p);
-        // pdf = dot(rec.normal, scattered.direction()) / M_PI;
-        // return true;
-
-        // // New version
-        // vec3 direction;
-        // do {
-        //     direction = random_in_unit_sphere();
-        // } while (dot(direction, rec.normal) < 0);
-        // scattered = Ray(rec.p, unit_vector(direction), r_in.time());
-        // alb = albedo->value(rec.u, rec.v, rec.p);
-        // pdf = 0.5 / M_PI;
-        // return true;
-
-        // New new version
-        Onb uvw;
-        uvw.build_from_w(rec.normal);
-        vec3 direction = uvw.local(random_cosine_direction());
-        scattered = Ray(rec.p, unit_vector(direction), r_in.time());
-        alb = albedo->value(rec.u, rec.v, rec.p);
-        pdf = dot(uvw.w(), scattered.direction()) / M_PI;
+        srec.is_specular = false;
+        srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
+        srec.cosine_pdf = Cosine_pdf(rec.normal);
+        srec.pdf_ptr = &srec.cosine_pdf;
         return true;
     }
 
@@ -108,12 +93,14 @@ class Metal : public Material
         else
             fuzz = 1;
     }
-    virtual bool scatter(const Ray& r_in, const Hit_record& rec, vec3& attenuation, Ray& scattered) const
+    virtual bool scatter(const Ray& r_in, const Hit_record& rec, Scatter_record& srec) const
     {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = Ray(rec.p, reflected + fuzz * random_in_unit_sphere());
-        attenuation = albedo;
-        return (dot(scattered.direction(), rec.normal) > 0);
+        srec.specular_ray = Ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+        srec.is_specular = true;
+        srec.attenuation = albedo;
+        srec.pdf_ptr = NULL;
+        return (dot(srec.specular_ray.direction(), rec.normal) > 0);
     }
     vec3 albedo;
     float fuzz;
@@ -123,12 +110,14 @@ class Dielectric : public Material
 {
   public:
     Dielectric(float ri) : ref_idx(ri) {}
-    virtual bool scatter(const Ray& r_in, const Hit_record& rec, vec3& attenuation, Ray& scattered) const
+    virtual bool scatter(const Ray& r_in, const Hit_record& rec, Scatter_record& srec) const
     {
         vec3 outward_normal;
         vec3 reflected = reflect(r_in.direction(), rec.normal);
         float ni_over_nt;
-        attenuation = vec3(1.0, 1.0, 1.0);
+        srec.is_specular = true;
+        srec.attenuation = vec3(1.0, 1.0, 1.0);
+        srec.pdf_ptr = NULL;
         vec3 refracted;
         float reflect_prob;
         float cosine;
@@ -146,13 +135,12 @@ class Dielectric : public Material
         if (refract(r_in.direction(), outward_normal, ni_over_nt, refracted)) {
             reflect_prob = schlick(cosine, ref_idx);
         } else {
-            scattered = Ray(rec.p, reflected);
             reflect_prob = 1.0;
         }
-        if (drand48() < reflect_prob) {
-            scattered = Ray(rec.p, reflected);
+        if (random_float() < reflect_prob) {
+            srec.specular_ray = Ray(rec.p, reflected, r_in.time());
         } else {
-            scattered = Ray(rec.p, refracted);
+            srec.specular_ray = Ray(rec.p, refracted, r_in.time());
         }
         return true;
     }
@@ -164,12 +152,15 @@ class Isotropic : public Material
 {
   public:
     Isotropic(Texture* a) : albedo(a) {}
-    virtual bool scatter(const Ray& r_in, const Hit_record& rec, vec3& attenuation, Ray& scattered) const
+    virtual bool scatter(const Ray& r_in, const Hit_record& rec, Scatter_record& srec) const
     {
-        scattered = Ray(rec.p, random_in_unit_sphere());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        static const Sphere_pdf sphere_pdf;
+        srec.is_specular = false;
+        srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
+        srec.pdf_ptr = &sphere_pdf;
         return true;
     }
+    virtual float scattering_pdf(const Ray& r_in, const Hit_record& rec, const Ray& scattered) const { return 1 / (4 * M_PI); }
     Texture* albedo;
 };
 
@@ -177,14 +168,15 @@ class Diffuse_light : public Material
 {
   public:
     Diffuse_light(Texture* a) : emit(a) {}
-    virtual bool scatter(const Ray& r_in, const Hit_record& rec, vec3& attenuation, Ray& scattered) const { return false; }
+    // Emits on the side the normal points to
     virtual vec3 emitted(const Ray& r_in, const Hit_record rec, float u, float v, const vec3& p) const
     {
-        if (dot(rec.normal, r_in.direction()) > 0)
+        if (dot(rec.normal, r_in.direction()) < 0)
             return emit->value(u, v, p);
         else
             return vec3(0, 0, 0);
     }
+    virtual bool is_emitter() const { return true; }
     Texture* emit;
 };
 
@@ -0,0 +1,591 @@
+#ifndef MESHLOADERH
+#define MESHLOADERH
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "parallel.h"
+#include "vec3.h"
+
+/*
+ * Read-only memory mapping of a whole file
+ */
+class Mapped_file
+{
+  public:
+    Mapped_file(const char* path) : data(NULL), size(0)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = (const char*)p;
+                size = size_t(st.st_size);
+                madvise(p, size, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+    }
+    ~Mapped_file()
+    {
+        if (data) munmap((void*)data, size);
+    }
+    bool valid() const { return data != NULL; }
+    const char* data;
+    size_t size;
+
+  private:
+    Mapped_file(const Mapped_file&);
+    Mapped_file& operator=(const Mapped_file&);
+};
+
+/*
+ * Indexed triangles as loaded from disk, ready to be moved into a Triangle_mesh. normals and uvs are
+ * either empty or hold one entry (two floats for uvs) per position.
+ */
+struct Mesh_data {
+    std::vector<vec3> positions;
+    std::vector<vec3> normals;
+    std::vector<float> uvs;
+    std::vector<int> indices;
+};
+
+/**************************************************************************************************************/
+/*
+ * OBJ
+ */
+
+inline bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char* skip_blanks(const char* p, const char* end)
+{
+    while (p < end && is_blank(*p)) p++;
+    return p;
+}
+
+inline const char* next_line(const char* p, const char* end)
+{
+    const char* nl = (const char*)memchr(p, '\n', size_t(end - p));
+    return nl ? nl + 1 : end;
+}
+
+/*
+ * Locale-independent decimal parser that never reads past end. Digits are gathered into an integer
+ * and scaled once by an exact power of ten, so short decimals round like strtof.
+ */
+inline float parse_float(const char*& p, const char* end)
+{
+    static const double pow10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    p = skip_blanks(p, end);
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int n_digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (n_digits < 18) {
+            mantissa = mantissa * 10 + uint64_t(*p - '0');
+            if (mantissa) n_digits++;
+        } else {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (n_digits < 18) {
+                mantissa = mantissa * 10 + uint64_t(*p - '0');
+                if (mantissa) n_digits++;
+                exponent--;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool neg_exp = false;
+        if (p < end && (*p == '-' || *p == '+')) neg_exp = *p++ == '-';
+        int e = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (e < 10000) e = e * 10 + (*p - '0');
+            p++;
+        }
+        exponent += neg_exp ? -e : e;
+    }
+    double value = double(mantissa);
+    if (exponent < 0)
+        value = exponent >= -22 ? value / pow10[-exponent] : value * pow(10.0, exponent);
+    else if (exponent > 0)
+        value = exponent <= 22 ? value * pow10[exponent] : value * pow(10.0, exponent);
+    return float(neg ? -value : value);
+}
+
+inline long parse_int(const char*& p, const char* end)
+{
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+    long value = 0;
+    while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+    return neg ? -value : value;
+}
+
+/*
+ * Line counts of one chunk of an OBJ file, then the global offsets its output starts at
+ */
+struct Obj_chunk {
+    const char* begin;
+    const char* end;
+    long n_v, n_vn, n_vt, n_tris;
+    long v_offset, vn_offset, vt_offset, tri_offset;
+    bool attributes_shared;  // every corner uses the same index for v, vt and vn
+    bool ok;
+};
+
+/*
+ * Parses one face corner "v", "v/vt", "v//vn" or "v/vt/vn" into 0-based indices (-1 when absent).
+ * Negative OBJ indices are relative to the n_* elements read so far.
+ */
+inline bool parse_obj_corner(const char*& p, const char* end, long n_v, long n_vt, long n_vn, long& v, long& vt, long& vn)
+{
+    p = skip_blanks(p, end);
+    if (p >= end || *p == '\n' || *p == '#') return false;
+    v = parse_int(p, end);
+    vt = vn = 0;
+    if (p < end && *p == '/') {
+        p++;
+        if (p < end && *p != '/') vt = parse_int(p, end);
+        if (p < end && *p == '/') {
+            p++;
+            vn = parse_int(p, end);
+        }
+    }
+    while (p < end && !is_blank(*p) && *p != '\n') p++;
+    v = v > 0 ? v - 1 : n_v + v;
+    vt = vt > 0 ? vt - 1 : (vt < 0 ? n_vt + vt : -1);
+    vn = vn > 0 ? vn - 1 : (vn < 0 ? n_vn + vn : -1);
+    return true;
+}
+
+/*
+ * First pass over a chunk (count == true) sizes its output; the second one fills the shared arrays
+ * from the chunk's offsets
+ */
+void parse_obj_chunk(Obj_chunk& c, bool count, Mesh_data& mesh, std::vector<vec3>& vn, std::vector<float>& vt)
+{
+    long n_v = 0, n_vn = 0, n_vt = 0, n_tris = 0;
+    c.attributes_shared = true;
+    c.ok = true;
+    for (const char* p = c.begin; p < c.end; p = next_line(p, c.end)) {
+        const char* q = skip_blanks(p, c.end);
+        if (q + 1 >= c.end) continue;
+        if (q[0] == 'v' && is_blank(q[1])) {
+            q += 2;
+            if (!count) {
+                vec3& pos = mesh.positions[c.v_offset + n_v];
+                for (int a = 0; a < 3; a++) pos[a] = parse_float(q, c.end);
+            }
+            n_v++;
+        } else if (q[0] == 'v' && q[1] == 'n' && q + 2 < c.end && is_blank(q[2])) {
+            q += 3;
+            if (!count) {
+                vec3& n = vn[c.vn_offset + n_vn];
+                for (int a = 0; a < 3; a++) n[a] = parse_float(q, c.end);
+            }
+            n_vn++;
+        } else if (q[0] == 'v' && q[1] == 't' && q + 2 < c.end && is_blank(q[2])) {
+            q += 3;
+            if (!count) {
+                vt[2 * (c.vt_offset + n_vt)] = parse_float(q, c.end);
+                vt[2 * (c.vt_offset + n_vt) + 1] = parse_float(q, c.end);
+            }
+            n_vt++;
+        } else if (q[0] == 'f' && is_blank(q[1])) {
+            // Polygons are fanned around their first corner
+            q++;
+            long first = -1, prev = -1, corner, corner_vt, corner_vn;
+            int n_corners = 0;
+            while (parse_obj_corner(q, c.end, c.v_offset + n_v, c.vt_offset + n_vt, c.vn_offset + n_vn, corner, corner_vt, corner_vn)) {
+                if ((corner_vt >= 0 && corner_vt != corner) || (corner_vn >= 0 && corner_vn != corner)) c.attributes_shared = false;
+                if (n_corners >= 2) {
+                    if (!count) {
+                        int* tri = &mesh.indices[3 * (c.tri_offset + n_tris)];
+                        tri[0] = int(first);
+                        tri[1] = int(prev);
+                        tri[2] = int(corner);
+                    }
+                    n_tris++;
+                }
+                if (n_corners == 0) first = corner;
+                prev = corner;
+                n_corners++;
+            }
+            if (n_corners < 3) c.ok = false;
+        }
+    }
+    c.n_v = n_v;
+    c.n_vn = n_vn;
+    c.n_vt = n_vt;
+    c.n_tris = n_tris;
+}
+
+bool load_obj(const char* path, Mesh_data& mesh, int n_threads = 0)
+{
+    Mapped_file file(path);
+    if (!file.valid()) {
+        std::cerr << "cannot read " << path << "\n";
+        return false;
+    }
+    const char* data = file.data;
+    const char* end = data + file.size;
+
+    // Chunks are cut at line boundaries, a few MB each at least
+    int n_chunks = n_threads > 0 ? n_threads : hardware_threads();
+    long min_chunk = 1 << 22;
+    if (long(file.size) / n_chunks < min_chunk) n_chunks = int(std::max(1L, long(file.size) / min_chunk));
+    std::vector<Obj_chunk> chunks(n_chunks);
+    const char* cut = data;
+    for (int c = 0; c < n_chunks; c++) {
+        chunks[c].begin = cut;
+        cut = (c == n_chunks - 1) ? end : next_line(std::max(cut, data + long(file.size) * (c + 1) / n_chunks - 1), end);
+        chunks[c].end = cut;
+    }
+
+    std::vector<vec3> vn;
+    std::vector<float> vt;
+    parallel_chunks(n_chunks, n_chunks, [&](int chunk, long, long) { parse_obj_chunk(chunks[chunk], true, mesh, vn, vt); });
+    long n_v = 0, n_vn = 0, n_vt = 0, n_tris = 0;
+    for (int c = 0; c < n_chunks; c++) {
+        chunks[c].v_offset = n_v;
+        chunks[c].vn_offset = n_vn;
+        chunks[c].vt_offset = n_vt;
+        chunks[c].tri_offset = n_tris;
+        n_v += chunks[c].n_v;
+        n_vn += chunks[c].n_vn;
+        n_vt += chunks[c].n_vt;
+        n_tris += chunks[c].n_tris;
+    }
+    mesh.positions.resize(n_v);
+    mesh.indices.resize(3 * n_tris);
+    vn.resize(n_vn);
+    vt.resize(2 * n_vt);
+    parallel_chunks(n_chunks, n_chunks, [&](int chunk, long, long) { parse_obj_chunk(chunks[chunk], false, mesh, vn, vt); });
+
+    bool shared = true;
+    for (int c = 0; c < n_chunks; c++) {
+        if (!chunks[c].ok) {
+            std::cerr << path << ": face with fewer than three corners\n";
+            return false;
+        }
+        shared = shared && chunks[c].attributes_shared;
+    }
+    for (long i = 0; i < 3 * n_tris; i++) {
+        if (mesh.indices[i] < 0 || mesh.indices[i] >= n_v) {
+            std::cerr << path << ": vertex index out of range\n";
+            return false;
+        }
+    }
+
+    // Normals and uvs are only kept when they are indexed like the positions
+    if (shared && n_vn == n_v) mesh.normals.swap(vn);
+    if (shared && n_vt == n_v) mesh.uvs.swap(vt);
+    if ((n_vn > 0 && mesh.normals.empty()) || (n_vt > 0 && mesh.uvs.empty()))
+        std::cerr << path << ": normals/uvs not indexed like the positions, ignored\n";
+    return true;
+}
+
+/**************************************************************************************************************/
+/*
+ * Binary PLY
+ */
+
+struct Ply_property {
+    std::string name;
+    int size;         // bytes of a scalar property, or of the list items
+    int count_size;   // bytes of the list count, 0 for scalars
+    bool is_float;    // float or double
+    bool is_signed;
+};
+
+inline int ply_type_size(const std::string& t, bool& is_float, bool& is_signed)
+{
+    is_float = (t == "float" || t == "float32" || t == "double" || t == "float64");
+    is_signed = !(t[0] == 'u');
+    if (t == "char" || t == "uchar" || t == "int8" || t == "uint8") return 1;
+    if (t == "short" || t == "ushort" || t == "int16" || t == "uint16") return 2;
+    if (t == "int" || t == "uint" || t == "int32" || t == "uint32" || t == "float" || t == "float32") return 4;
+    if (t == "double" || t == "float64") return 8;
+    return 0;
+}
+
+inline uint64_t read_bytes(const unsigned char* p, int size, bool swap)
+{
+    uint64_t v = 0;
+    for (int b = 0; b < size; b++) v |= uint64_t(p[swap ? size - 1 - b : b]) << (8 * b);
+    return v;
+}
+
+inline double read_scalar(const unsigned char* p, const Ply_property& prop, bool swap)
+{
+    int size = prop.size;
+    uint64_t bits = read_bytes(p, size, swap);
+    if (prop.is_float && size == 4) {
+        uint32_t b32 = uint32_t(bits);
+        float f;
+        memcpy(&f, &b32, 4);
+        return f;
+    }
+    if (prop.is_float) {
+        double d;
+        memcpy(&d, &bits, 8);
+        return d;
+    }
+    if (prop.is_signed && size < 8 && (bits >> (8 * size - 1)) & 1) return double(int64_t(bits) - (int64_t(1) << (8 * size)));
+    return double(bits);
+}
+
+inline long read_count(const unsigned char* p, int size, bool swap) { return long(read_bytes(p, size, swap)); }
+
+bool load_ply(const char* path, Mesh_data& mesh, int n_threads = 0)
+{
+    Mapped_file file(path);
+    if (!file.valid()) {
+        std::cerr << "cannot read " << path << "\n";
+        return false;
+    }
+    const char* header_end = NULL;
+    for (const char* p = file.data; p < file.data + file.size; p = next_line(p, file.data + file.size)) {
+        if (!strncmp(p, "end_header", 10)) {
+            header_end = next_line(p, file.data + file.size);
+            break;
+        }
+    }
+    if (strncmp(file.data, "ply", 3) || !header_end) {
+        std::cerr << path << ": not a PLY file\n";
+        return false;
+    }
+
+    // Header: format, then each element with its properties
+    bool swap = false;
+    long n_vertices = 0, n_faces = 0;
+    std::vector<Ply_property> vertex_props, face_props;
+    std::vector<Ply_property>* current = NULL;
+    std::string header(file.data, header_end);
+    size_t pos = 0;
+    while (pos < header.size()) {
+        size_t eol = header.find('\n', pos);
+        if (eol == std::string::npos) eol = header.size();
+        std::vector<std::string> words;
+        size_t w = pos;
+        while (w < eol) {
+            while (w < eol && is_blank(header[w])) w++;
+            size_t s = w;
+            while (w < eol && !is_blank(header[w])) w++;
+            if (w > s) words.push_back(header.substr(s, w - s));
+        }
+        pos = eol + 1;
+        if (words.empty()) continue;
+        if (words[0] == "format") {
+            if (words.size() < 2 || words[1] == "ascii") {
+                std::cerr << path << ": only binary PLY is supported\n";
+                return false;
+            }
+            swap = words[1] == "binary_big_endian";
+        } else if (words[0] == "element" && words.size() >= 3) {
+            long n = atol(words[2].c_str());
+            if (words[1] == "vertex") {
+                n_vertices = n;
+                current = &vertex_props;
+            } else if (words[1] == "face") {
+                n_faces = n;
+                current = &face_props;
+            } else {
+                if (n > 0 && (n_vertices == 0 || n_faces == 0)) {
+                    std::cerr << path << ": element '" << words[1] << "' before vertices and faces is not supported\n";
+                    return false;
+                }
+                current = NULL;
+            }
+        } else if (words[0] == "property" && current) {
+            Ply_property prop;
+            bool f, s;
+            if (words.size() >= 5 && words[1] == "list") {
+                prop.count_size = ply_type_size(words[2], f, s);
+                prop.size = ply_type_size(words[3], prop.is_float, prop.is_signed);
+                prop.name = words[4];
+            } else if (words.size() >= 3) {
+                prop.count_size = 0;
+                prop.size = ply_type_size(words[1], prop.is_float, prop.is_signed);
+                prop.name = words[2];
+            } else {
+                prop.size = 0;
+            }
+            if (prop.size == 0) {
+                std::cerr << path << ": bad property line\n";
+                return false;
+            }
+            current->push_back(prop);
+        }
+    }
+
+    // Vertices are fixed-size records, decoded in parallel
+    int vertex_size = 0;
+    int field[8];  // x y z nx ny nz u v -> property index
+    const char* names[8][2] = { { "x", "x" }, { "y", "y" }, { "z", "z" }, { "nx", "nx" }, { "ny", "ny" }, { "nz", "nz" }, { "u", "s" }, { "v", "t" } };
+    for (int k = 0; k < 8; k++) field[k] = -1;
+    std::vector<int> prop_offset(vertex_props.size());
+    for (size_t i = 0; i < vertex_props.size(); i++) {
+        if (vertex_props[i].count_size) {
+            std::cerr << path << ": list properties on vertices are not supported\n";
+            return false;
+        }
+        prop_offset[i] = vertex_size;
+        vertex_size += vertex_props[i].size;
+        for (int k = 0; k < 8; k++)
+            if (vertex_props[i].name == names[k][0] || vertex_props[i].name == names[k][1]) field[k] = int(i);
+    }
+    if (field[0] < 0 || field[1] < 0 || field[2] < 0) {
+        std::cerr << path << ": vertices without x, y, z\n";
+        return false;
+    }
+    const unsigned char* vdata = (const unsigned char*)header_end;
+    const unsigned char* fdata = vdata + long(vertex_size) * n_vertices;
+    const unsigned char* file_end = (const unsigned char*)file.data + file.size;
+    if (fdata > file_end) {
+        std::cerr << path << ": truncated vertex data\n";
+        return false;
+    }
+    bool has_normals = field[3] >= 0 && field[4] >= 0 && field[5] >= 0;
+    bool has_uvs = field[6] >= 0 && field[7] >= 0;
+    mesh.positions.resize(n_vertices);
+    if (has_normals) mesh.normals.resize(n_vertices);
+    if (has_uvs) mesh.uvs.resize(2 * n_vertices);
+    int n_chunks = n_vertices >= (1 << 16) ? (n_threads > 0 ? n_threads : hardware_threads()) : 1;
+    parallel_chunks(n_vertices, n_chunks, [&](int, long begin, long end) {
+        for (long i = begin; i < end; i++) {
+            const unsigned char* rec = vdata + long(vertex_size) * i;
+            float v[8];
+            for (int k = 0; k < 8; k++) {
+                if (field[k] < 0) continue;
+                const Ply_property& prop = vertex_props[field[k]];
+                v[k] = float(read_scalar(rec + prop_offset[field[k]], prop, swap));
+            }
+            mesh.positions[i] = vec3(v[0], v[1], v[2]);
+            if (has_normals) mesh.normals[i] = vec3(v[3], v[4], v[5]);
+            if (has_uvs) {
+                mesh.uvs[2 * i] = v[6];
+                mesh.uvs[2 * i + 1] = v[7];
+            }
+        }
+    });
+
+    // Faces: the common all-triangle layout has fixed-size records and is decoded in parallel,
+    // anything else is walked once to find the record offsets
+    int list = -1;
+    int face_fixed = 0;  // bytes of the scalar face properties
+    for (size_t i = 0; i < face_props.size(); i++) {
+        if (face_props[i].count_size && (face_props[i].name == "vertex_indices" || face_props[i].name == "vertex_index"))
+            list = int(i);
+        else if (face_props[i].count_size) {
+            std::cerr << path << ": extra list properties on faces are not supported\n";
+            return false;
+        } else
+            face_fixed += face_props[i].size;
+    }
+    if (list < 0) {
+        std::cerr << path << ": faces without vertex_indices\n";
+        return false;
+    }
+    const Ply_property& lp = face_props[list];
+    int list_before = 0;
+    for (int i = 0; i < list; i++) list_before += face_props[i].size;
+    long tri_record = face_fixed + lp.count_size + 3 * lp.size;
+
+    bool all_triangles = fdata + tri_record * n_faces <= file_end;
+    if (all_triangles) {
+        n_chunks = n_faces >= (1 << 16) ? (n_threads > 0 ? n_threads : hardware_threads()) : 1;
+        std::vector<char> chunk_ok(n_chunks, 1);
+        parallel_chunks(n_faces, n_chunks, [&](int chunk, long begin, long end) {
+            for (long i = begin; i < end; i++)
+                if (read_count(fdata + tri_record * i + list_before, lp.count_size, swap) != 3) chunk_ok[chunk] = 0;
+        });
+        for (int c = 0; c < n_chunks; c++) all_triangles = all_triangles && chunk_ok[c];
+    }
+
+    if (all_triangles) {
+        mesh.indices.resize(3 * n_faces);
+        parallel_chunks(n_faces, n_chunks, [&](int, long begin, long end) {
+            for (long i = begin; i < end; i++) {
+                const unsigned char* items = fdata + tri_record * i + list_before + lp.count_size;
+                for (int k = 0; k < 3; k++) mesh.indices[3 * i + k] = int(read_bytes(items + k * lp.size, lp.size, swap));
+            }
+        });
+    } else {
+        const unsigned char* p = fdata;
+        mesh.indices.clear();
+        for (long i = 0; i < n_faces; i++) {
+            if (p + face_fixed + lp.count_size > file_end) break;
+            long n = read_count(p + list_before, lp.count_size, swap);
+            const unsigned char* items = p + list_before + lp.count_size;
+            if (items + n * lp.size > file_end) break;
+            int first = int(read_bytes(items, lp.size, swap));
+            for (long k = 2; k < n; k++) {
+                mesh.indices.push_back(first);
+                mesh.indices.push_back(int(read_bytes(items + (k - 1) * lp.size, lp.size, swap)));
+                mesh.indices.push_back(int(read_bytes(items + k * lp.size, lp.size, swap)));
+            }
+            p += face_fixed + lp.count_size + n * lp.size;
+        }
+    }
+    for (size_t i = 0; i < mesh.indices.size(); i++) {
+        if (mesh.indices[i] < 0 || mesh.indices[i] >= n_vertices) {
+            std::cerr << path << ": vertex index out of range or truncated face data\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Loads an .obj or .ply file depending on its extension
+ */
+bool load_mesh(const char* path, Mesh_data& mesh, int n_threads = 0)
+{
+    const char* ext = strrchr(path, '.');
+    if (ext && !strcasecmp(ext, ".obj")) return load_obj(path, mesh, n_threads);
+    if (ext && !strcasecmp(ext, ".ply")) return load_ply(path, mesh, n_threads);
+    std::cerr << path << ": unknown mesh format\n";
+    return false;
+}
+
+/*
+ * Uniformly scales and moves the mesh so its bounding box is size wide along its largest extent,
+ * centered on center horizontally and resting on center.y()
+ */
+void fit_mesh(Mesh_data& mesh, const vec3& center, float size)
+{
+    if (mesh.positions.empty()) return;
+    vec3 lo = mesh.positions[0], hi = mesh.positions[0];
+    for (size_t i = 1; i < mesh.positions.size(); i++) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], mesh.positions[i][a]);
+            hi[a] = std::max(hi[a], mesh.positions[i][a]);
+        }
+    }
+    vec3 extent = hi - lo;
+    float scale = size / std::max(extent.x(), std::max(extent.y(), extent.z()));
+    vec3 anchor(0.5f * (lo.x() + hi.x()), lo.y(), 0.5f * (lo.z() + hi.z()));
+    for (size_t i = 0; i < mesh.positions.size(); i++) mesh.positions[i] = center + scale * (mesh.positions[i] - anchor);
+}
+
+#endif  // MESHLOADERH
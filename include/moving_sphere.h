@@ -3,6 +3,7 @@
 
 #include "hitable.h"
 #include "ray.h"
+#include "render_stats.h"
 
 class Moving_sphere : public Hitable
 {
@@ -12,6 +13,8 @@ class Moving_sphere : public Hitable
       : center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m){};
     virtual bool hit(const Ray& r, float tmin, float tmax, Hit_record& rec) const;
     bool bounding_box(float t0, float t1, Aabb& box) const;
+    virtual void finalize(const Ray& r, Hit_record& rec) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const;
     vec3 center(float time) const;
     vec3 center0, center1;
     float time0, time1;
@@ -22,32 +25,48 @@ class Moving_sphere : public Hitable
 vec3 Moving_sphere::center(const float time) const { return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0); }
 bool Moving_sphere::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
 {
+    STAT_INC(STAT_MOVING_SPHERE_TESTS);
     vec3 oc = r.origin() - center(r.time());
     float a = dot(r.direction(), r.direction());
     float b = dot(oc, r.direction());
     float c = dot(oc, oc) - radius * radius;
     float discriminant = b * b - a * c;
     if (discriminant > 0) {
-        float temp = (-b - sqrt(discriminant)) / a;
+        float root = sqrt(discriminant);
+        float temp = (-b - root) / a;
+        if (!(temp < t_max && temp > t_min)) temp = (-b + root) / a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center(r.time())) / radius;
-            rec.mat_ptr = mat_ptr;
-            return true;
-        }
-        temp = (-b + sqrt(discriminant)) / a;
-        if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center(r.time())) / radius;
-            rec.mat_ptr = mat_ptr;
+            rec.hitable = this;
             return true;
         }
     }
     return false;
 }
 
+void Moving_sphere::finalize(const Ray& r, Hit_record& rec) const
+{
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center(r.time())) / radius;
+    rec.mat_ptr = mat_ptr;
+}
+
+bool Moving_sphere::occluded(const Ray& r, float t_min, float t_max) const
+{
+    STAT_INC(STAT_MOVING_SPHERE_TESTS);
+    vec3 oc = r.origin() - center(r.time());
+    float a = dot(r.direction(), r.direction());
+    float b = dot(oc, r.direction());
+    float c = dot(oc, oc) - radius * radius;
+    float discriminant = b * b - a * c;
+    if (discriminant <= 0) return false;
+    float root = sqrt(discriminant);
+    float temp = (-b - root) / a;
+    if (temp < t_max && temp > t_min) return true;
+    temp = (-b + root) / a;
+    return temp < t_max && temp > t_min;
+}
+
 bool Moving_sphere::bounding_box(float t0, float t1, Aabb& box) const
 {
     Aabb box0(center(t0) - vec3(radius, radius, radius), center(t0) + vec3(radius, radius, radius));
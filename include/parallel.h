@@ -0,0 +1,214 @@
+#ifndef PARALLELH
+#define PARALLELH
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline int hardware_threads()
+{
+    int n = int(std::thread::hardware_concurrency());
+    return n > 0 ? n : 1;
+}
+
+/*
+ * Tasks handed to a Task_pool under one group, which Task_pool::wait blocks on
+ */
+struct Task_group {
+    Task_group() : pending(0) {}
+    int pending;  // guarded by the pool's lock
+};
+
+/**************************************************************************************************************/
+/*
+ * Class Task_pool
+ *
+ * Fixed set of worker threads sharing one queue. A thread waiting on a group runs queued tasks in the
+ * meantime, so tasks may fork tasks of their own and wait for them without blocking a thread each,
+ * and nested parallel loops never run more threads than the workers and their callers.
+ */
+class Task_pool
+{
+  public:
+    explicit Task_pool(int n_workers);
+    ~Task_pool();
+    void run(Task_group& group, const std::function<void()>& f);
+    void wait(Task_group& group);
+
+  private:
+    struct Task {
+        std::function<void()> f;
+        Task_group* group;
+    };
+    void work();
+    void execute(std::unique_lock<std::mutex>& guard, const Task& task);
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Task> queue;
+    std::vector<std::thread> workers;
+    bool stopping;
+};
+
+Task_pool::Task_pool(int n_workers) : stopping(false)
+{
+    for (int t = 0; t < n_workers; t++) workers.push_back(std::thread(&Task_pool::work, this));
+}
+
+Task_pool::~Task_pool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+}
+
+// Without workers f runs right away on the calling thread
+void Task_pool::run(Task_group& group, const std::function<void()>& f)
+{
+    if (workers.empty()) {
+        f();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Task task;
+        task.f = f;
+        task.group = &group;
+        queue.push_back(task);
+        group.pending++;
+    }
+    changed.notify_one();
+}
+
+// Runs task with guard released, then counts it done
+void Task_pool::execute(std::unique_lock<std::mutex>& guard, const Task& task)
+{
+    guard.unlock();
+    task.f();
+    guard.lock();
+    task.group->pending--;
+    changed.notify_all();
+}
+
+/*
+ * Workers take the oldest task, the largest one when tasks fork recursively
+ */
+void Task_pool::work()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        while (!stopping && queue.empty()) changed.wait(guard);
+        if (queue.empty()) return;
+        Task task = queue.front();
+        queue.pop_front();
+        execute(guard, task);
+    }
+}
+
+/*
+ * Returns once every task of group is done. Meanwhile the caller runs the newest queued tasks, most
+ * likely its own group's.
+ */
+void Task_pool::wait(Task_group& group)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (group.pending > 0) {
+        if (queue.empty()) {
+            changed.wait(guard);
+            continue;
+        }
+        Task task = queue.back();
+        queue.pop_back();
+        execute(guard, task);
+    }
+}
+
+/*
+ * The pool shared by every parallel loop and fork: one worker per hardware thread besides the caller.
+ * It is never destroyed, so exiting does not wait on its idle workers.
+ */
+inline Task_pool& task_pool()
+{
+    static Task_pool* pool = new Task_pool(hardware_threads() - 1);
+    return *pool;
+}
+
+/*
+ * Splits [0, n) into n_chunks contiguous ranges and calls f(chunk, begin, end) for each of them on
+ * the shared pool, the calling thread taking chunk 0
+ */
+template <typename F>
+void parallel_chunks(long n, int n_chunks, const F& f)
+{
+    if (n_chunks <= 1) {
+        f(0, 0, n);
+        return;
+    }
+    Task_pool& pool = task_pool();
+    Task_group group;
+    for (int c = 1; c < n_chunks; c++) pool.run(group, [&f, n, n_chunks, c]() { f(c, n * c / n_chunks, n * (c + 1) / n_chunks); });
+    f(0, 0, n / n_chunks);
+    pool.wait(group);
+}
+
+/*
+ * Runs a on the shared pool and b on the calling thread, returning once both are done
+ */
+template <typename A, typename B>
+void parallel_invoke(const A& a, const B& b)
+{
+    Task_pool& pool = task_pool();
+    Task_group group;
+    pool.run(group, a);
+    b();
+    pool.wait(group);
+}
+
+/*
+ * Stable partition of items[0, n) by pred in n_chunks parallel parts: each chunk counts its items
+ * that satisfy pred, prefix sums of the counts place every chunk on both sides, and the chunks
+ * scatter into a copy that is then copied back. Returns the number of items that satisfy pred.
+ */
+template <typename T, typename P>
+long parallel_partition(T* items, long n, int n_chunks, const P& pred)
+{
+    std::vector<long> n_true(n_chunks, 0);
+    parallel_chunks(n, n_chunks, [&](int c, long begin, long end) {
+        long k = 0;
+        for (long i = begin; i < end; i++)
+            if (pred(items[i])) k++;
+        n_true[c] = k;
+    });
+    std::vector<long> true_at(n_chunks), false_at(n_chunks);
+    long total = 0;
+    for (int c = 0; c < n_chunks; c++) {
+        true_at[c] = total;
+        total += n_true[c];
+    }
+    long next = total;
+    for (int c = 0; c < n_chunks; c++) {
+        false_at[c] = next;
+        next += n * (c + 1) / n_chunks - n * c / n_chunks - n_true[c];
+    }
+
+    std::vector<T> scattered(n);
+    parallel_chunks(n, n_chunks, [&](int c, long begin, long end) {
+        long t = true_at[c], f = false_at[c];
+        for (long i = begin; i < end; i++) {
+            if (pred(items[i]))
+                scattered[t++] = items[i];
+            else
+                scattered[f++] = items[i];
+        }
+    });
+    parallel_chunks(n, n_chunks, [&](int, long begin, long end) { std::copy(scattered.begin() + begin, scattered.begin() + end, items + begin); });
+    return total;
+}
+
+#endif  // PARALLELH
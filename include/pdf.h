@@ -0,0 +1,91 @@
+#ifndef PDFH
+#define PDFH
+
+#include <math.h>
+
+#include "hitable.h"
+#include "onb.h"
+#include "random.h"
+
+vec3 random_cosine_direction()
+{
+    float r1 = random_float();
+    float r2 = random_float();
+    float z = sqrt(1 - r2);
+    float phi = 2 * M_PI * r1;
+    float x = cos(phi) * sqrt(r2);
+    float y = sin(phi) * sqrt(r2);
+    return vec3(x, y, z);
+}
+
+/*
+ * Power heuristic (beta = 2) weight of a sample drawn with density f_pdf when another strategy would
+ * have drawn it with density g_pdf
+ */
+inline float power_heuristic(float f_pdf, float g_pdf)
+{
+    float f2 = f_pdf * f_pdf;
+    float g2 = g_pdf * g_pdf;
+    return f2 + g2 > 0 ? f2 / (f2 + g2) : 0;
+}
+
+/**************************************************************************************************************/
+/*
+ * Class Pdf
+ *
+ * Density over directions, in solid angle, that can also be sampled
+ */
+class Pdf
+{
+  public:
+    virtual float value(const vec3& direction) const = 0;
+    virtual vec3 generate() const = 0;
+};
+
+/*
+ * Cosine-weighted hemisphere around w
+ */
+class Cosine_pdf : public Pdf
+{
+  public:
+    Cosine_pdf() {}
+    Cosine_pdf(const vec3& w) { uvw.build_from_w(w); }
+    virtual float value(const vec3& direction) const
+    {
+        float cosine = dot(unit_vector(direction), uvw.w());
+        return cosine > 0 ? cosine / M_PI : 0;
+    }
+    virtual vec3 generate() const { return uvw.local(random_cosine_direction()); }
+    Onb uvw;
+};
+
+/*
+ * Uniform over the whole sphere of directions
+ */
+class Sphere_pdf : public Pdf
+{
+  public:
+    virtual float value(const vec3& direction) const { return 1 / (4 * M_PI); }
+    virtual vec3 generate() const
+    {
+        float z = 1 - 2 * random_float();
+        float phi = 2 * M_PI * random_float();
+        float s = sqrt(1 - z * z);
+        return vec3(cos(phi) * s, sin(phi) * s, z);
+    }
+};
+
+/*
+ * Directions from origin toward a Hitable sampled through its pdf_value/random, such as a list of lights
+ */
+class Hitable_pdf : public Pdf
+{
+  public:
+    Hitable_pdf(const Hitable* p, const vec3& origin) : ptr(p), o(origin) {}
+    virtual float value(const vec3& direction) const { return ptr->pdf_value(o, direction); }
+    virtual vec3 generate() const { return ptr->random(o); }
+    const Hitable* ptr;
+    vec3 o;
+};
+
+#endif  // PDFH
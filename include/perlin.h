@@ -1,6 +1,7 @@
 #ifndef PERLINH
 #define PERLINH
 
+#include "random.h"
 #include "vec3.h"
 
 inline float trilinear_interp(float c[2][2][2], float u, float v, float w)
@@ -29,9 +30,15 @@ inline float perlin_interp(vec3 c[2][2][2], float u, float v, float w)
     return accum;
 }
 
+/*
+ * Gradient noise over a lattice of 256 random unit vectors, indexed through three random permutations.
+ * The tables are drawn from the calling thread's generator when the noise is constructed, so they
+ * follow the scene seed.
+ */
 class Perlin
 {
   public:
+    Perlin();
     float noise(const vec3& p) const
     {
         float u = p.x() - floor(p.x());
@@ -58,25 +65,16 @@ class Perlin
         }
         return fabs(accum);
     }
-    static vec3* ranvec;
-    static int* perm_x;
-    static int* perm_y;
-    static int* perm_z;
+    vec3 ranvec[256];
+    int perm_x[256];
+    int perm_y[256];
+    int perm_z[256];
 };
 
-static vec3* perlin_generate()
-{
-    vec3* p = new vec3[256];
-    for (int i = 0; i < 256; ++i) {
-        p[i] = unit_vector(vec3(-1 + 2 * drand48(), -1 + 2 * drand48(), -1 + 2 * drand48()));
-    }
-    return p;
-}
-
 void permute(int* p, int n)
 {
     for (int i = n - 1; i > 0; i--) {
-        int target = int(drand48() * (i + 1));
+        int target = int(random_float() * (i + 1));
         int tmp = p[i];
         p[i] = p[target];
         p[target] = tmp;
@@ -84,19 +82,22 @@ void permute(int* p, int n)
     return;
 }
 
-static int* perlin_generate_perm()
+static void perlin_generate_perm(int* p)
 {
-    int* p = new int[256];
     for (int i = 0; i < 256; i++) {
         p[i] = i;
     }
     permute(p, 256);
-    return p;
 }
 
-vec3* Perlin::ranvec = perlin_generate();
-int* Perlin::perm_x = perlin_generate_perm();
-int* Perlin::perm_y = perlin_generate_perm();
-int* Perlin::perm_z = perlin_generate_perm();
+Perlin::Perlin()
+{
+    for (int i = 0; i < 256; ++i) {
+        ranvec[i] = unit_vector(vec3(-1 + 2 * random_float(), -1 + 2 * random_float(), -1 + 2 * random_float()));
+    }
+    perlin_generate_perm(perm_x);
+    perlin_generate_perm(perm_y);
+    perlin_generate_perm(perm_z);
+}
 
 #endif
@@ -0,0 +1,71 @@
+#ifndef RANDOMH
+#define RANDOMH
+
+#include <stdint.h>
+
+/*
+ * PCG32 (XSH-RR) generator: 64 bits of state plus a stream selector, so reseeding is two LCG steps
+ */
+class Rng
+{
+  public:
+    Rng() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+    Rng(uint64_t initstate, uint64_t initseq) { seed(initstate, initseq); }
+    void seed(uint64_t initstate, uint64_t initseq)
+    {
+        state = 0;
+        inc = (initseq << 1) | 1;
+        next_uint();
+        state += initstate;
+        next_uint();
+    }
+    inline uint32_t next_uint()
+    {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+        uint32_t rot = uint32_t(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+    // Uniform in [0, 1): the top 24 bits fill the float mantissa exactly
+    inline float next_float() { return (next_uint() >> 8) * (1.0f / 16777216.0f); }
+    uint64_t state;
+    uint64_t inc;
+};
+
+/*
+ * 64-bit finalizer (splitmix64), used to turn structured indices into uncorrelated seeds
+ */
+inline uint64_t mix_bits(uint64_t v)
+{
+    v ^= v >> 30;
+    v *= 0xbf58476d1ce4e5b9ULL;
+    v ^= v >> 27;
+    v *= 0x94d049bb133111ebULL;
+    v ^= v >> 31;
+    return v;
+}
+
+/*
+ * Generator used by every sampling routine of the calling thread. The renderer reseeds it for each
+ * pixel sample, so results do not depend on which thread renders which tile.
+ */
+inline Rng& thread_rng()
+{
+    static thread_local Rng rng;
+    return rng;
+}
+
+inline float random_float() { return thread_rng().next_float(); }
+
+/*
+ * Position the calling thread's generator on sample s of pixel (i, j). The sample index is hashed
+ * into the state on one fixed stream: PCG streams that differ only in their increment are correlated.
+ */
+inline void seed_pixel_sample(uint64_t seed, int i, int j, int s)
+{
+    uint64_t pixel = (uint64_t(uint32_t(j)) << 32) | uint32_t(i);
+    thread_rng().seed(mix_bits(mix_bits(seed ^ mix_bits(pixel)) ^ uint64_t(s)), 0xda3e39cb94b95bdbULL);
+}
+
+#endif  // RANDOMH
@@ -11,6 +11,8 @@ class Ray
         A = a;
         B = b;
         _time = ti;
+        inv_dir = vec3(1, 1, 1) / b;
+        for (int k = 0; k < 3; k++) dir_is_neg[k] = inv_dir[k] < 0;
     }
     vec3 origin() const { return A; }
     vec3 direction() const { return B; }
@@ -19,6 +21,9 @@ class Ray
     vec3 A;
     vec3 B;
     float _time;
+    // Per-ray constants of the slab tests: zero components become signed infinities
+    vec3 inv_dir;
+    int dir_is_neg[3];
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,131 @@
+#ifndef RENDERSTATSH
+#define RENDERSTATSH
+
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+/*
+ * Ray and traversal counters, compiled in with -DRENDER_STATS. Without it the STAT_ macros expand to
+ * nothing and the counted code is unchanged. Each thread counts into its own block, so rendering
+ * shares no counter between threads; a block is folded into the retired totals when its thread
+ * exits, and merge_render_stats adds the blocks of the threads still running.
+ */
+
+enum Stat_counter {
+    STAT_PATHS,
+    STAT_CAMERA_RAYS,
+    STAT_BOUNCE_RAYS,
+    STAT_SHADOW_RAYS,
+    STAT_PATH_VERTICES,  // surface and medium hits along paths
+    STAT_BVH_NODES,      // nodes visited, of every layout; a Bvh4 node tests four boxes
+    STAT_LIST_QUERIES,   // Hitable_list hit and occluded calls
+    STAT_LIST_CHILDREN,  // members those calls tested
+    STAT_SPHERE_TESTS,
+    STAT_MOVING_SPHERE_TESTS,
+    STAT_RECT_TESTS,
+    STAT_TRIANGLE_TESTS,
+    STAT_MEDIUM_QUERIES,
+    STAT_MEDIUM_BOUNDARY_QUERIES,  // hit queries of the media boundaries, two per entered boundary
+    N_STAT_COUNTERS
+};
+
+struct Render_stats {
+    Render_stats() { memset(n, 0, sizeof(n)); }
+    uint64_t n[N_STAT_COUNTERS];
+};
+
+#ifdef RENDER_STATS
+
+struct Stats_block;
+
+struct Stats_registry {
+    std::mutex lock;
+    Render_stats retired;
+    std::vector<const Stats_block*> live;
+};
+
+inline Stats_registry& stats_registry()
+{
+    static Stats_registry registry;
+    return registry;
+}
+
+struct Stats_block {
+    Stats_block()
+    {
+        std::lock_guard<std::mutex> guard(stats_registry().lock);
+        stats_registry().live.push_back(this);
+    }
+    ~Stats_block()
+    {
+        Stats_registry& registry = stats_registry();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        for (int c = 0; c < N_STAT_COUNTERS; c++) registry.retired.n[c] += counts.n[c];
+        for (size_t k = 0; k < registry.live.size(); k++) {
+            if (registry.live[k] == this) {
+                registry.live.erase(registry.live.begin() + k);
+                break;
+            }
+        }
+    }
+    Render_stats counts;
+};
+
+inline Render_stats& thread_stats()
+{
+    static thread_local Stats_block block;
+    return block.counts;
+}
+
+#define STAT_INC(c) (thread_stats().n[c]++)
+#define STAT_ADD(c, k) (thread_stats().n[c] += (k))
+
+// BVH nodes visited and primitives tested by the calling thread so far
+inline uint64_t thread_traversal_work()
+{
+    const uint64_t* n = thread_stats().n;
+    return n[STAT_BVH_NODES] + n[STAT_SPHERE_TESTS] + n[STAT_MOVING_SPHERE_TESTS] + n[STAT_RECT_TESTS] + n[STAT_TRIANGLE_TESTS];
+}
+
+/*
+ * Totals over every thread so far. Exact once the render threads are joined; a snapshot otherwise.
+ */
+Render_stats merge_render_stats()
+{
+    Stats_registry& registry = stats_registry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    Render_stats total = registry.retired;
+    for (size_t k = 0; k < registry.live.size(); k++)
+        for (int c = 0; c < N_STAT_COUNTERS; c++) total.n[c] += registry.live[k]->counts.n[c];
+    return total;
+}
+
+void print_render_stats(std::ostream& os, const Render_stats& stats)
+{
+    const uint64_t* n = stats.n;
+    double rays = double(n[STAT_CAMERA_RAYS] + n[STAT_BOUNCE_RAYS] + n[STAT_SHADOW_RAYS]);
+    double per_ray = rays > 0 ? 1 / rays : 0;
+    os << "---RAY STATS--- : " << n[STAT_CAMERA_RAYS] << " camera, " << n[STAT_BOUNCE_RAYS] << " bounce, " << n[STAT_SHADOW_RAYS] << " shadow rays"
+       << std::endl;
+    os << "---PATH STATS--- : " << n[STAT_PATHS] << " paths, " << (n[STAT_PATHS] ? double(n[STAT_PATH_VERTICES]) / n[STAT_PATHS] : 0)
+       << " vertices per path" << std::endl;
+    os << "---TRAVERSAL STATS--- : per ray " << n[STAT_BVH_NODES] * per_ray << " BVH nodes, " << n[STAT_LIST_QUERIES] * per_ray << " lists of "
+       << (n[STAT_LIST_QUERIES] ? double(n[STAT_LIST_CHILDREN]) / n[STAT_LIST_QUERIES] : 0) << " members" << std::endl;
+    os << "---PRIMITIVE STATS--- : per ray " << n[STAT_SPHERE_TESTS] * per_ray << " spheres, " << n[STAT_MOVING_SPHERE_TESTS] * per_ray
+       << " moving spheres, " << n[STAT_RECT_TESTS] * per_ray << " rects, " << n[STAT_TRIANGLE_TESTS] * per_ray << " triangles, "
+       << n[STAT_MEDIUM_QUERIES] * per_ray << " media (" << n[STAT_MEDIUM_BOUNDARY_QUERIES] * per_ray << " boundary queries)" << std::endl;
+}
+
+#else
+
+#define STAT_INC(c) ((void)0)
+#define STAT_ADD(c, k) ((void)0)
+
+inline uint64_t thread_traversal_work() { return 0; }
+
+#endif  // RENDER_STATS
+
+#endif  // RENDERSTATSH
@@ -0,0 +1,251 @@
+#ifndef SCENECACHEH
+#define SCENECACHEH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "bvh_build.h"
+#include "linear_bvh.h"
+#include "mesh_loader.h"
+#include "random.h"
+#include "triangle_mesh.h"
+
+/*
+ * Binary cache of the expensive parts of a scene: loaded meshes with their built BVH and decoded
+ * images. A cache file is a header followed by 16-byte aligned arrays written in native byte order,
+ * read back by mapping the file and copying the arrays out, without any parsing. The header key is a
+ * hash of the source file's key (see source_file_key) and of everything that affects the cached
+ * result, so any change to either makes the entry stale and it is rebuilt and rewritten.
+ */
+
+const uint32_t cache_version = 3;
+const uint32_t cache_byte_order = 0x01020304;
+
+enum Cache_kind { CACHE_MESH = 1, CACHE_IMAGE = 2, CACHE_CHECKPOINT = 3 };
+
+struct Cache_header {
+    char magic[8];  // "RTCACHE"
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t kind;
+    uint32_t node_size;
+    uint64_t key;
+    uint64_t counts[6];  // per-kind array lengths
+};
+
+inline uint64_t cache_align(uint64_t offset) { return (offset + 15) & ~uint64_t(15); }
+
+/*
+ * 64-bit content hash, eight bytes per step
+ */
+inline uint64_t hash_bytes(const void* data, size_t n, uint64_t seed = 0)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t h = mix_bits(seed ^ n);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        h = mix_bits(h ^ word) + 0x9e3779b97f4a7c15ULL;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p + i, n - i);
+    return mix_bits(h ^ tail);
+}
+
+inline bool hash_file(const char* path, uint64_t& h)
+{
+    Mapped_file file(path);
+    if (!file.valid()) return false;
+    h = hash_bytes(file.data, file.size);
+    return true;
+}
+
+/*
+ * Where scene sources are cached and how they are recognised
+ */
+struct Scene_cache {
+    Scene_cache() : dir(NULL), hash_content(false) {}
+    const char* dir;    // NULL for no cache
+    bool hash_content;  // key sources on their whole content instead of their size and modification time
+};
+
+/*
+ * Key of a source file: a hash of its path, size and modification time, which needs no read of the
+ * file, or with hash_content of everything in it, which also notices edits that keep the size and
+ * time. Returns false if the file cannot be found or read.
+ */
+inline bool source_file_key(const char* path, bool hash_content, uint64_t& key)
+{
+    if (hash_content) return hash_file(path, key);
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+    uint64_t values[3] = { uint64_t(st.st_size), uint64_t(st.st_mtim.tv_sec), uint64_t(st.st_mtim.tv_nsec) };
+    key = hash_bytes(values, sizeof(values), hash_bytes(path, strlen(path)));
+    return true;
+}
+
+/*
+ * Hash of the build parameters that change the BVH a builder produces
+ */
+inline uint64_t hash_bvh_params(const Bvh_build_params& params, uint64_t seed)
+{
+    float values[5] = { float(params.method), float(params.n_bins), float(params.max_leaf_size), params.traversal_cost,
+                        params.intersection_cost };
+    return hash_bytes(values, sizeof(values), seed);
+}
+
+/*
+ * Cache file for source in directory dir, named after the source file and a hash of its full path
+ */
+inline std::string cache_file_name(const char* dir, const char* source, const char* ext)
+{
+    const char* base = strrchr(source, '/');
+    base = base ? base + 1 : source;
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash_bytes(source, strlen(source)));
+    return std::string(dir) + "/" + base + "." + hex + ext;
+}
+
+/*
+ * Maps file and checks its header against kind and key. Returns the header, or NULL on a miss.
+ */
+inline const Cache_header* open_cache(const Mapped_file& file, uint32_t kind, uint64_t key)
+{
+    if (!file.valid() || file.size < sizeof(Cache_header)) return NULL;
+    const Cache_header* h = (const Cache_header*)file.data;
+    if (memcmp(h->magic, "RTCACHE", 8) || h->version != cache_version || h->byte_order != cache_byte_order || h->kind != kind ||
+        h->node_size != sizeof(Linear_bvh_node) || h->key != key)
+        return NULL;
+    return h;
+}
+
+/*
+ * Writes the header and arrays (data, size in bytes) to a temporary file renamed over file, so an
+ * interrupted write never leaves a truncated entry behind
+ */
+inline bool write_cache(const std::string& file, uint32_t kind, uint64_t key, const uint64_t counts[6], const void* const* arrays,
+                        const uint64_t* sizes, int n_arrays)
+{
+    Cache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "RTCACHE", 8);
+    h.version = cache_version;
+    h.byte_order = cache_byte_order;
+    h.kind = kind;
+    h.node_size = sizeof(Linear_bvh_node);
+    h.key = key;
+    for (int c = 0; c < 6; c++) h.counts[c] = counts[c];
+
+    std::string tmp = file + ".tmp";
+    std::ofstream out(tmp.c_str(), std::ios::binary);
+    if (!out) return false;
+    out.write((const char*)&h, sizeof(h));
+    uint64_t offset = sizeof(h);
+    static const char zeros[16] = { 0 };
+    for (int a = 0; a < n_arrays; a++) {
+        uint64_t aligned = cache_align(offset);
+        out.write(zeros, std::streamsize(aligned - offset));
+        if (sizes[a]) out.write((const char*)arrays[a], std::streamsize(sizes[a]));
+        offset = aligned + sizes[a];
+    }
+    out.close();
+    if (!out || rename(tmp.c_str(), file.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**************************************************************************************************************/
+/*
+ * Meshes: positions, normals, uvs, leaf-ordered indices and BVH nodes of a Triangle_mesh
+ */
+
+inline void copy_positions(const float* src, size_t n, std::vector<vec3>& dst)
+{
+    dst.resize(n);
+    for (size_t i = 0; i < n; i++) dst[i] = vec3(src[3 * i], src[3 * i + 1], src[3 * i + 2]);
+}
+
+/*
+ * Returns a mesh rebuilt from the cache entry in file, or NULL if it is missing or stale
+ */
+Triangle_mesh* read_mesh_cache(const std::string& file, uint64_t key, Material* m)
+{
+    Mapped_file map(file.c_str());
+    const Cache_header* h = open_cache(map, CACHE_MESH, key);
+    if (!h) return NULL;
+    uint64_t n_positions = h->counts[0], n_normals = h->counts[1], n_uvs = h->counts[2], n_indices = h->counts[3], n_nodes = h->counts[4];
+    uint64_t sizes[5] = { 12 * n_positions, 12 * n_normals, 4 * n_uvs, 4 * n_indices, sizeof(Linear_bvh_node) * n_nodes };
+    const char* arrays[5];
+    uint64_t offset = sizeof(Cache_header);
+    for (int a = 0; a < 5; a++) {
+        offset = cache_align(offset);
+        arrays[a] = map.data + offset;
+        offset += sizes[a];
+    }
+    if (offset > map.size) return NULL;
+
+    std::vector<vec3> positions, normals;
+    copy_positions((const float*)arrays[0], n_positions, positions);
+    copy_positions((const float*)arrays[1], n_normals, normals);
+    std::vector<float> uvs((const float*)arrays[2], (const float*)arrays[2] + n_uvs);
+    std::vector<int> indices((const int*)arrays[3], (const int*)arrays[3] + n_indices);
+    std::vector<Linear_bvh_node> nodes((const Linear_bvh_node*)arrays[4], (const Linear_bvh_node*)arrays[4] + n_nodes);
+    return new Triangle_mesh(std::move(positions), std::move(indices), std::move(nodes), m, std::move(normals), std::move(uvs));
+}
+
+bool write_mesh_cache(const std::string& file, uint64_t key, const Triangle_mesh& mesh)
+{
+    std::vector<float> positions(3 * mesh.positions.size()), normals(3 * mesh.normals.size());
+    for (size_t i = 0; i < mesh.positions.size(); i++)
+        for (int a = 0; a < 3; a++) positions[3 * i + a] = mesh.positions[i][a];
+    for (size_t i = 0; i < mesh.normals.size(); i++)
+        for (int a = 0; a < 3; a++) normals[3 * i + a] = mesh.normals[i][a];
+    uint64_t counts[6] = { mesh.positions.size(), mesh.normals.size(), mesh.uvs.size(), mesh.indices.size(), mesh.nodes.size(), 0 };
+    const void* arrays[5] = { positions.data(), normals.data(), mesh.uvs.data(), mesh.indices.data(), mesh.nodes.data() };
+    uint64_t sizes[5] = { 4 * positions.size(), 4 * normals.size(), 4 * mesh.uvs.size(), 4 * mesh.indices.size(),
+                          sizeof(Linear_bvh_node) * mesh.nodes.size() };
+    return write_cache(file, CACHE_MESH, key, counts, arrays, sizes, 5);
+}
+
+/**************************************************************************************************************/
+/*
+ * Images: decoded 8-bit pixels
+ */
+
+/*
+ * Returns a malloc'ed copy of the cached pixels, or NULL if the entry is missing or stale
+ */
+unsigned char* read_image_cache(const std::string& file, uint64_t key, int* nx, int* ny, int* nn)
+{
+    Mapped_file map(file.c_str());
+    const Cache_header* h = open_cache(map, CACHE_IMAGE, key);
+    if (!h) return NULL;
+    uint64_t size = h->counts[0] * h->counts[1] * h->counts[2];
+    uint64_t offset = cache_align(sizeof(Cache_header));
+    if (size == 0 || offset + size > map.size) return NULL;
+    unsigned char* pixels = (unsigned char*)malloc(size);
+    if (!pixels) return NULL;
+    memcpy(pixels, map.data + offset, size);
+    *nx = int(h->counts[0]);
+    *ny = int(h->counts[1]);
+    *nn = int(h->counts[2]);
+    return pixels;
+}
+
+bool write_image_cache(const std::string& file, uint64_t key, const unsigned char* pixels, int nx, int ny, int nn)
+{
+    uint64_t counts[6] = { uint64_t(nx), uint64_t(ny), uint64_t(nn), 0, 0, 0 };
+    const void* arrays[1] = { pixels };
+    uint64_t sizes[1] = { uint64_t(nx) * ny * nn };
+    return write_cache(file, CACHE_IMAGE, key, counts, arrays, sizes, 1);
+}
+
+#endif  // SCENECACHEH
@@ -1,7 +1,26 @@
 #ifndef SPHEREH
 #define SPHEREH
 
+#include <float.h>
+
 #include "hitable.h"
+#include "material.h"
+#include "onb.h"
+#include "random.h"
+#include "render_stats.h"
+
+/*
+ * Direction uniformly distributed in the cone of half-angle acos(cos_theta_max) around +z
+ */
+inline vec3 random_to_sphere(float cos_theta_max)
+{
+    float r1 = random_float();
+    float r2 = random_float();
+    float z = 1 + r2 * (cos_theta_max - 1);
+    float phi = 2 * M_PI * r1;
+    float s = sqrt(1 - z * z);
+    return vec3(cos(phi) * s, sin(phi) * s, z);
+}
 
 class Sphere : public Hitable
 {
@@ -10,6 +29,14 @@ class Sphere : public Hitable
     Sphere(vec3 cen, float r, Material* m) : center(cen), radius(r), mat_ptr(m){};
     virtual bool hit(const Ray& r, float tmin, float tmax, Hit_record& rec) const;
     virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+    virtual void finalize(const Ray& r, Hit_record& rec) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const;
+    virtual float pdf_value(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const;
+    virtual void collect_lights(std::vector<Hitable*>& lights)
+    {
+        if (mat_ptr->is_emitter()) lights.push_back(this);
+    }
     vec3 center;
     float radius;
     Material* mat_ptr;
@@ -17,38 +44,75 @@ class Sphere : public Hitable
 
 bool Sphere::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
 {
+    STAT_INC(STAT_SPHERE_TESTS);
     vec3 oc = r.origin() - center;
     float a = dot(r.direction(), r.direction());
     float b = dot(oc, r.direction());
     float c = dot(oc, oc) - radius * radius;
     float discriminant = b * b - a * c;
     if (discriminant > 0) {
-        float temp = (-b - sqrt(b * b - a * c)) / a;
+        float root = sqrt(discriminant);
+        float temp = (-b - root) / a;
+        if (!(temp < t_max && temp > t_min)) temp = (-b + root) / a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
-            return true;
-        }
-        temp = (-b + sqrt(b * b - a * c)) / a;
-        if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
+            rec.hitable = this;
             return true;
         }
     }
     return false;
 }
 
+void Sphere::finalize(const Ray& r, Hit_record& rec) const
+{
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center) / radius;
+    get_sphere_uv(rec.normal, rec.u, rec.v);
+    rec.mat_ptr = mat_ptr;
+}
+
+bool Sphere::occluded(const Ray& r, float t_min, float t_max) const
+{
+    STAT_INC(STAT_SPHERE_TESTS);
+    vec3 oc = r.origin() - center;
+    float a = dot(r.direction(), r.direction());
+    float b = dot(oc, r.direction());
+    float c = dot(oc, oc) - radius * radius;
+    float discriminant = b * b - a * c;
+    if (discriminant <= 0) return false;
+    float root = sqrt(discriminant);
+    float temp = (-b - root) / a;
+    if (temp < t_max && temp > t_min) return true;
+    temp = (-b + root) / a;
+    return temp < t_max && temp > t_min;
+}
+
 bool Sphere::bounding_box(float t0, float t1, Aabb& box) const
 {
     box = Aabb(center - vec3(radius, radius, radius), center + vec3(radius, radius, radius));
     return true;
 }
 
+/*
+ * Spheres are sampled over the cone of directions they subtend from o, which is empty from inside
+ */
+float Sphere::pdf_value(const vec3& o, const vec3& v) const
+{
+    if (!occluded(Ray(o, v), 0.001, FLT_MAX)) return 0;
+    float distance_squared = (center - o).squared_length();
+    if (distance_squared <= radius * radius) return 0;
+    float cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+    return 1 / (2 * M_PI * (1 - cos_theta_max));
+}
+
+vec3 Sphere::random(const vec3& o) const
+{
+    vec3 direction = center - o;
+    float distance_squared = direction.squared_length();
+    if (distance_squared <= radius * radius) return direction;
+    Onb uvw;
+    uvw.build_from_w(direction);
+    return uvw.local(random_to_sphere(sqrt(1 - radius * radius / distance_squared)));
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,223 @@
+#ifndef TILESCHEDULERH
+#define TILESCHEDULERH
+
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Image region [x0, x1) x [y0, y1) rendered as one unit of work
+ */
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+enum Tile_order { TILE_ORDER_SCANLINE, TILE_ORDER_SPIRAL, TILE_ORDER_HILBERT };
+
+struct Thread_stats {
+    double busy;  // seconds spent inside the tile callback
+    double idle;  // seconds spent looking for work or waiting for the other threads
+    int tiles;
+    int stolen;
+};
+
+/*
+ * Distance of (x, y) along a Hilbert curve filling a n x n grid (n power of two)
+ */
+inline long hilbert_index(int n, int x, int y)
+{
+    long d = 0;
+    for (int s = n / 2; s > 0; s /= 2) {
+        int rx = (x & s) > 0;
+        int ry = (y & s) > 0;
+        d += long(s) * long(s) * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            int t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+/**************************************************************************************************************/
+/*
+ * Class Tile_scheduler
+ *
+ * Splits the image into tiles, deals them in curve order to per-thread deques and lets idle threads
+ * steal from the back of the other deques. Owners pop from the front so each thread keeps walking a
+ * coherent stretch of the curve.
+ */
+class Tile_scheduler
+{
+  public:
+    Tile_scheduler(int nx, int ny, int tile_size, Tile_order order, int nthreads = 0);
+    void run(const std::function<void(const Tile& tile, int thread_id)>& render_tile);
+    void reset();
+    void report(std::ostream& os) const;
+    std::vector<Tile> tiles;
+    std::vector<Thread_stats> stats;
+    int n_threads;
+    double wall_time;
+
+  private:
+    struct Work_queue {
+        std::mutex lock;
+        std::deque<int> items;
+    };
+    bool next_tile(int thread_id, int& tile, bool& stolen);
+    void worker(int thread_id, const std::function<void(const Tile&, int)>& render_tile);
+    std::vector<Work_queue> queues;
+};
+
+Tile_scheduler::Tile_scheduler(int nx, int ny, int tile_size, Tile_order order, int nthreads)
+{
+    n_threads = nthreads > 0 ? nthreads : int(std::thread::hardware_concurrency());
+    if (n_threads < 1) n_threads = 1;
+    reset();
+    if (tile_size < 1) tile_size = 1;
+
+    int tx = (nx + tile_size - 1) / tile_size;
+    int ty = (ny + tile_size - 1) / tile_size;
+    int n = 1;
+    while (n < tx || n < ty) n *= 2;
+
+    // Tiles are keyed by their position along the chosen curve, then sorted
+    std::vector<std::pair<long, Tile> > keyed;
+    keyed.reserve(tx * ty);
+    for (int j = 0; j < ty; j++) {
+        for (int i = 0; i < tx; i++) {
+            Tile t;
+            t.x0 = i * tile_size;
+            t.y0 = j * tile_size;
+            t.x1 = std::min(t.x0 + tile_size, nx);
+            t.y1 = std::min(t.y0 + tile_size, ny);
+            long key;
+            if (order == TILE_ORDER_HILBERT) {
+                key = hilbert_index(n, i, j);
+            } else if (order == TILE_ORDER_SPIRAL) {
+                // Rings of increasing Chebyshev distance from the image center, walked by angle
+                float dx = i - 0.5f * (tx - 1);
+                float dy = j - 0.5f * (ty - 1);
+                long ring = long(std::max(fabs(dx), fabs(dy)) + 0.5f);
+                long angle = long(1000.0f * (atan2(dy, dx) + M_PI));
+                key = ring * 10000 + angle;
+            } else {
+                key = long(j) * tx + i;
+            }
+            keyed.push_back(std::make_pair(key, t));
+        }
+    }
+    std::stable_sort(keyed.begin(), keyed.end(),
+                     [](const std::pair<long, Tile>& a, const std::pair<long, Tile>& b) { return a.first < b.first; });
+    tiles.resize(keyed.size());
+    for (size_t k = 0; k < keyed.size(); k++) tiles[k] = keyed[k].second;
+}
+
+bool Tile_scheduler::next_tile(int thread_id, int& tile, bool& stolen)
+{
+    {
+        Work_queue& own = queues[thread_id];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.items.empty()) {
+            tile = own.items.front();
+            own.items.pop_front();
+            stolen = false;
+            return true;
+        }
+    }
+    // Tiles are never re-queued, so one empty pass over every victim means the frame is done
+    for (int k = 1; k < n_threads; k++) {
+        Work_queue& victim = queues[(thread_id + k) % n_threads];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.items.empty()) {
+            tile = victim.items.back();
+            victim.items.pop_back();
+            stolen = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Tile_scheduler::worker(int thread_id, const std::function<void(const Tile&, int)>& render_tile)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    Thread_stats& st = stats[thread_id];
+    int tile;
+    bool stolen;
+    while (next_tile(thread_id, tile, stolen)) {
+        Clock::time_point t0 = Clock::now();
+        render_tile(tiles[tile], thread_id);
+        st.busy += std::chrono::duration<double>(Clock::now() - t0).count();
+        st.tiles++;
+        if (stolen) st.stolen++;
+    }
+}
+
+/*
+ * Clears the stats and wall time that successive runs add up
+ */
+void Tile_scheduler::reset()
+{
+    Thread_stats zero = { 0, 0, 0, 0 };
+    stats.assign(n_threads, zero);
+    wall_time = 0;
+}
+
+void Tile_scheduler::run(const std::function<void(const Tile& tile, int thread_id)>& render_tile)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    Clock::time_point start = Clock::now();
+
+    // Deal contiguous runs of the curve to each thread
+    std::vector<Work_queue> fresh(n_threads);
+    queues.swap(fresh);
+    int n_tiles = int(tiles.size());
+    for (int t = 0; t < n_threads; t++) {
+        int first = int(long(n_tiles) * t / n_threads);
+        int last = int(long(n_tiles) * (t + 1) / n_threads);
+        for (int k = first; k < last; k++) queues[t].items.push_back(k);
+    }
+    std::vector<double> busy_before(n_threads);
+    for (int t = 0; t < n_threads; t++) busy_before[t] = stats[t].busy;
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < n_threads; t++) threads.push_back(std::thread(&Tile_scheduler::worker, this, t, std::cref(render_tile)));
+    worker(0, render_tile);
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    wall_time += elapsed;
+    for (int t = 0; t < n_threads; t++) stats[t].idle += std::max(0.0, elapsed - (stats[t].busy - busy_before[t]));
+}
+
+void Tile_scheduler::report(std::ostream& os) const
+{
+    double busy = 0;
+    os << "---TILES--- : " << tiles.size() << " tiles on " << n_threads << " threads" << std::endl;
+    for (int t = 0; t < n_threads; t++) {
+        const Thread_stats& st = stats[t];
+        busy += st.busy;
+        os << "  thread " << std::setw(3) << t << " : busy " << std::fixed << std::setprecision(3) << st.busy << "s  idle " << st.idle
+           << "s  tiles " << st.tiles << "  stolen " << st.stolen << std::endl;
+    }
+    if (wall_time > 0)
+        os << "---PARALLEL EFFICIENCY--- : " << std::setprecision(1) << 100.0 * busy / (wall_time * n_threads) << "%" << std::endl;
+    os.unsetf(std::ios::fixed);
+    os << std::setprecision(6);
+}
+
+#endif  // TILESCHEDULERH
@@ -0,0 +1,240 @@
+#ifndef TRIANGLEMESHH
+#define TRIANGLEMESHH
+
+#include <chrono>
+#include <utility>
+#include <vector>
+
+#include "bvh_build.h"
+#include "hitable.h"
+#include "linear_bvh.h"
+#include "render_stats.h"
+
+/*
+ * Per-ray constants of the watertight ray/triangle test (Woop, Benthin, Wald 2013): the direction is
+ * sheared so that it becomes the +z axis of the permuted frame (kx, ky, kz).
+ */
+struct Watertight_ray {
+    Watertight_ray(const Ray& r)
+    {
+        vec3 d = r.direction();
+        kz = 0;
+        if (fabs(d[1]) > fabs(d[kz])) kz = 1;
+        if (fabs(d[2]) > fabs(d[kz])) kz = 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (d[kz] < 0) std::swap(kx, ky);  // keep the winding
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1.0f / d[kz];
+        org = r.origin();
+    }
+    vec3 org;
+    int kx, ky, kz;
+    float sx, sy, sz;
+};
+
+/*
+ * Intersects triangle (p0, p1, p2). On a hit in (t_min, t_max), returns t and the barycentric
+ * weights b1, b2 of p1 and p2.
+ */
+inline bool intersect_triangle(const Watertight_ray& wr, const vec3& p0, const vec3& p1, const vec3& p2, float t_min, float t_max, float& t,
+                               float& b1, float& b2)
+{
+    STAT_INC(STAT_TRIANGLE_TESTS);
+    vec3 a = p0 - wr.org;
+    vec3 b = p1 - wr.org;
+    vec3 c = p2 - wr.org;
+    float ax = a[wr.kx] - wr.sx * a[wr.kz];
+    float ay = a[wr.ky] - wr.sy * a[wr.kz];
+    float bx = b[wr.kx] - wr.sx * b[wr.kz];
+    float by = b[wr.ky] - wr.sy * b[wr.kz];
+    float cx = c[wr.kx] - wr.sx * c[wr.kz];
+    float cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    if (u == 0 || v == 0 || w == 0) {
+        // Edge or vertex hit: redo the edge functions in double precision so neighbours agree
+        u = float(double(cx) * double(by) - double(cy) * double(bx));
+        v = float(double(ax) * double(cy) - double(ay) * double(cx));
+        w = float(double(bx) * double(ay) - double(by) * double(ax));
+    }
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+    float det = u + v + w;
+    if (det == 0) return false;
+
+    float inv_det = 1.0f / det;
+    t = (u * wr.sz * a[wr.kz] + v * wr.sz * b[wr.kz] + w * wr.sz * c[wr.kz]) * inv_det;
+    if (!(t > t_min && t < t_max)) return false;
+    b1 = v * inv_det;
+    b2 = w * inv_det;
+    return true;
+}
+
+/**************************************************************************************************************/
+/*
+ * Class Triangle_mesh
+ *
+ * Indexed triangles sharing vertex positions, optional per-vertex normals and uvs (two floats per
+ * vertex), intersected through an internal flattened BVH over triangle indices. The index buffer
+ * is reordered to the BVH leaf order, so leaves address triangles directly. Triangles are two-sided:
+ * hit normals face the ray whatever the winding, so refractive materials see every hit as entering.
+ */
+class Triangle_mesh : public Hitable
+{
+  public:
+    Triangle_mesh(std::vector<vec3> positions, std::vector<int> indices, Material* m, std::vector<vec3> normals = std::vector<vec3>(),
+                  std::vector<float> uvs = std::vector<float>(), const Bvh_build_params& params = Bvh_build_params());
+    // Adopts a BVH built earlier for this index buffer, already in leaf order
+    Triangle_mesh(std::vector<vec3> positions, std::vector<int> indices, std::vector<Linear_bvh_node> nodes, Material* m,
+                  std::vector<vec3> normals = std::vector<vec3>(), std::vector<float> uvs = std::vector<float>());
+    virtual bool hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const;
+    virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+    virtual void finalize(const Ray& r, Hit_record& rec) const;
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const;
+    int triangle_count() const { return int(indices.size() / 3); }
+    std::vector<vec3> positions;
+    std::vector<vec3> normals;
+    std::vector<float> uvs;
+    std::vector<int> indices;
+    std::vector<Linear_bvh_node> nodes;
+    Material* mat_ptr;
+};
+
+Triangle_mesh::Triangle_mesh(std::vector<vec3> p, std::vector<int> idx, Material* m, std::vector<vec3> n, std::vector<float> uv,
+                             const Bvh_build_params& params)
+  : mat_ptr(m)
+{
+    positions.swap(p);
+    indices.swap(idx);
+    normals.swap(n);
+    uvs.swap(uv);
+
+    int n_tris = triangle_count();
+    if (n_tris == 0) return;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+
+    std::vector<Bvh_primitive> prims(n_tris);
+    int n_chunks = n_tris >= bvh_parallel_threshold ? build_threads(params) : 1;
+    parallel_chunks(n_tris, n_chunks, [&](int chunk, long begin, long end) {
+        for (long i = begin; i < end; i++) {
+            const vec3& p0 = positions[indices[3 * i]];
+            const vec3& p1 = positions[indices[3 * i + 1]];
+            const vec3& p2 = positions[indices[3 * i + 2]];
+            Aabb box(p0, p0);
+            box.expand(Aabb(p1, p1));
+            box.expand(Aabb(p2, p2));
+            prims[i].box = box;
+            prims[i].centroid = 0.5 * (box._min + box._max);
+            prims[i].index = int(i);
+        }
+    });
+
+    nodes.reserve(2 * n_tris);
+    float cost = build_linear_bvh(prims, 0, n_tris, params, nodes);
+
+    std::vector<int> ordered(indices.size());
+    for (int i = 0; i < n_tris; i++) {
+        for (int k = 0; k < 3; k++) ordered[3 * i + k] = indices[3 * prims[i].index + k];
+    }
+    indices.swap(ordered);
+
+    if (params.stats) {
+        params.stats->n_builds++;
+        params.stats->n_primitives += n_tris;
+        params.stats->sah_cost += cost;
+        params.stats->build_time += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+}
+
+Triangle_mesh::Triangle_mesh(std::vector<vec3> p, std::vector<int> idx, std::vector<Linear_bvh_node> bvh, Material* m, std::vector<vec3> n,
+                             std::vector<float> uv)
+  : mat_ptr(m)
+{
+    positions.swap(p);
+    indices.swap(idx);
+    nodes.swap(bvh);
+    normals.swap(n);
+    uvs.swap(uv);
+}
+
+bool Triangle_mesh::hit(const Ray& r, float t_min, float t_max, Hit_record& rec) const
+{
+    if (nodes.empty()) return false;
+    Watertight_ray wr(r);
+    const vec3* pos = &positions[0];
+    const int* idx = &indices[0];
+    int hit_tri = -1;
+    float hit_t = t_max, hit_b1 = 0, hit_b2 = 0;
+    bool found = traverse_linear_bvh(&nodes[0], r, t_min, t_max, [&](int first, int count, float& t_closest) {
+        bool hit_leaf = false;
+        for (int tri = first; tri < first + count; tri++) {
+            float t, b1, b2;
+            if (intersect_triangle(wr, pos[idx[3 * tri]], pos[idx[3 * tri + 1]], pos[idx[3 * tri + 2]], t_min, t_closest, t, b1, b2)) {
+                t_closest = t;
+                hit_t = t;
+                hit_tri = tri;
+                hit_b1 = b1;
+                hit_b2 = b2;
+                hit_leaf = true;
+            }
+        }
+        return hit_leaf;
+    });
+    if (!found) return false;
+    rec.t = hit_t;
+    rec.u = hit_b1;
+    rec.v = hit_b2;
+    rec.prim_id = hit_tri;
+    rec.hitable = this;
+    return true;
+}
+
+void Triangle_mesh::finalize(const Ray& r, Hit_record& rec) const
+{
+    const vec3* pos = &positions[0];
+    int i0 = indices[3 * rec.prim_id], i1 = indices[3 * rec.prim_id + 1], i2 = indices[3 * rec.prim_id + 2];
+    float b1 = rec.u, b2 = rec.v;
+    float b0 = 1 - b1 - b2;
+    rec.p = r.point_at_parameter(rec.t);
+    // Triangles are two-sided, since mesh files do not wind them consistently: the geometric normal
+    // faces the ray, and interpolated normals are turned into its hemisphere
+    vec3 geometric = unit_vector(cross(pos[i1] - pos[i0], pos[i2] - pos[i0]));
+    if (dot(geometric, r.direction()) > 0) geometric = -geometric;
+    rec.normal = geometric;
+    if (!normals.empty()) {
+        vec3 shading = unit_vector(b0 * normals[i0] + b1 * normals[i1] + b2 * normals[i2]);
+        rec.normal = dot(shading, geometric) < 0 ? -shading : shading;
+    }
+    if (!uvs.empty()) {
+        rec.u = b0 * uvs[2 * i0] + b1 * uvs[2 * i1] + b2 * uvs[2 * i2];
+        rec.v = b0 * uvs[2 * i0 + 1] + b1 * uvs[2 * i1 + 1] + b2 * uvs[2 * i2 + 1];
+    }
+    rec.mat_ptr = mat_ptr;
+}
+
+bool Triangle_mesh::occluded(const Ray& r, float t_min, float t_max) const
+{
+    if (nodes.empty()) return false;
+    Watertight_ray wr(r);
+    const vec3* pos = &positions[0];
+    const int* idx = &indices[0];
+    return occluded_linear_bvh(&nodes[0], r, t_min, t_max, [&](int first, int count) {
+        float t, b1, b2;
+        for (int tri = first; tri < first + count; tri++)
+            if (intersect_triangle(wr, pos[idx[3 * tri]], pos[idx[3 * tri + 1]], pos[idx[3 * tri + 2]], t_min, t_max, t, b1, b2)) return true;
+        return false;
+    });
+}
+
+bool Triangle_mesh::bounding_box(float t0, float t1, Aabb& box) const
+{
+    if (nodes.empty()) return false;
+    const Linear_bvh_node& root = nodes[0];
+    box = Aabb(vec3(root.bmin[0], root.bmin[1], root.bmin[2]), vec3(root.bmax[0], root.bmax[1], root.bmax[2]));
+    return true;
+}
+
+#endif  // TRIANGLEMESHH
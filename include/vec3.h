@@ -5,16 +5,37 @@
 #include <stdlib.h>
 #include <iostream>
 
+/*
+ * Building with -DVEC3_SIMD keeps each vec3 in one SSE register, padded to four floats, and uses
+ * SSE4.1 dot products and FMA when the target has them (-march=native). The interface is the same,
+ * e[] included; only the storage and the operator bodies differ.
+ */
+#if defined(VEC3_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define VEC3_SSE
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#ifdef __FMA__
+#include <immintrin.h>
+#endif
+#endif
+
 class vec3
 {
   public:
     vec3() {}
+#ifdef VEC3_SSE
+    vec3(float e0, float e1, float e2) : m(_mm_set_ps(0.0f, e2, e1, e0)) {}
+    explicit vec3(__m128 v) : m(v) {}
+#else
     vec3(float e0, float e1, float e2)
     {
         e[0] = e0;
         e[1] = e1;
         e[2] = e2;
     }
+#endif
     inline float x() const { return e[0]; }
     inline float y() const { return e[1]; }
     inline float z() const { return e[2]; }
@@ -22,7 +43,11 @@ class vec3
     inline float g() const { return e[1]; }
     inline float b() const { return e[2]; }
     inline const vec3& operator+() const { return *this; }
+#ifdef VEC3_SSE
+    inline vec3 operator-() const { return vec3(_mm_xor_ps(m, _mm_set1_ps(-0.0f))); }
+#else
     inline vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+#endif
     inline float operator[](int i) const { return e[i]; }
     inline float& operator[](int i) { return e[i]; }
     inline vec3& operator+=(const vec3& v2);
@@ -32,11 +57,18 @@ class vec3
     inline vec3& operator*=(const float t);
     inline vec3& operator/=(const float t);
 
-    inline float length() const { return sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]); }
-    inline float squared_length() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
+    inline float length() const { return sqrt(squared_length()); }
+    inline float squared_length() const;
     inline void make_unit_vector();
 
+#ifdef VEC3_SSE
+    union {
+        __m128 m;
+        float e[4];  // e[3] is padding and holds anything
+    };
+#else
     float e[3];
+#endif
 };
 
 inline std::istream& operator>>(std::istream& is, vec3& t)
@@ -51,14 +83,89 @@ inline std::ostream& operator<<(std::ostream& os, const vec3& t)
     return os;
 }
 
-inline void vec3::make_unit_vector()
+inline void vec3::make_unit_vector() { *this *= float(1.0 / sqrt(squared_length())); }
+
+#ifdef VEC3_SSE
+
+/*
+ * Sum of the products of the first three lanes, in lane 0, added in the scalar order
+ */
+inline __m128 vec3_dot_ps(__m128 a, __m128 b)
 {
-    float k = 1.0 / sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
-    e[0] *= k;
-    e[1] *= k;
-    e[2] *= k;
+#ifdef __SSE4_1__
+    return _mm_dp_ps(a, b, 0x71);
+#else
+    __m128 p = _mm_mul_ps(a, b);
+    __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_add_ss(_mm_add_ss(p, y), z);
+#endif
+}
+
+inline float vec3::squared_length() const { return _mm_cvtss_f32(vec3_dot_ps(m, m)); }
+inline vec3 operator+(const vec3& v1, const vec3& v2) { return vec3(_mm_add_ps(v1.m, v2.m)); }
+inline vec3 operator-(const vec3& v1, const vec3& v2) { return vec3(_mm_sub_ps(v1.m, v2.m)); }
+inline vec3 operator*(const vec3& v1, const vec3& v2) { return vec3(_mm_mul_ps(v1.m, v2.m)); }
+inline vec3 operator/(const vec3& v1, const vec3& v2) { return vec3(_mm_div_ps(v1.m, v2.m)); }
+inline vec3 operator*(float t, const vec3& v) { return vec3(_mm_mul_ps(_mm_set1_ps(t), v.m)); }
+inline vec3 operator/(vec3 v, float t) { return vec3(_mm_div_ps(v.m, _mm_set1_ps(t))); }
+inline vec3 operator*(const vec3& v, float t) { return vec3(_mm_mul_ps(_mm_set1_ps(t), v.m)); }
+inline float dot(const vec3& v1, const vec3& v2) { return _mm_cvtss_f32(vec3_dot_ps(v1.m, v2.m)); }
+inline vec3 cross(const vec3& v1, const vec3& v2)
+{
+    // v1.yzx * v2.zxy - v1.zxy * v2.yzx
+    __m128 a_yzx = _mm_shuffle_ps(v1.m, v1.m, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_zxy = _mm_shuffle_ps(v2.m, v2.m, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 a_zxy = _mm_shuffle_ps(v1.m, v1.m, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 b_yzx = _mm_shuffle_ps(v2.m, v2.m, _MM_SHUFFLE(3, 0, 2, 1));
+#ifdef __FMA__
+    return vec3(_mm_fmsub_ps(a_yzx, b_zxy, _mm_mul_ps(a_zxy, b_yzx)));
+#else
+    return vec3(_mm_sub_ps(_mm_mul_ps(a_yzx, b_zxy), _mm_mul_ps(a_zxy, b_yzx)));
+#endif
+}
+
+inline vec3& vec3::operator+=(const vec3& v)
+{
+    m = _mm_add_ps(m, v.m);
+    return *this;
+}
+
+inline vec3& vec3::operator*=(const vec3& v)
+{
+    m = _mm_mul_ps(m, v.m);
+    return *this;
+}
+
+inline vec3& vec3::operator/=(const vec3& v)
+{
+    m = _mm_div_ps(m, v.m);
+    return *this;
+}
+
+inline vec3& vec3::operator-=(const vec3& v)
+{
+    m = _mm_sub_ps(m, v.m);
+    return *this;
+}
+
+inline vec3& vec3::operator*=(const float t)
+{
+    m = _mm_mul_ps(m, _mm_set1_ps(t));
+    return *this;
 }
 
+inline vec3& vec3::operator/=(const float t)
+{
+    float k = 1.0 / t;
+    m = _mm_mul_ps(m, _mm_set1_ps(k));
+    return *this;
+}
+
+#else
+
+inline float vec3::squared_length() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
+
 inline vec3 operator+(const vec3& v1, const vec3& v2) { return vec3(v1.e[0] + v2.e[0], v1.e[1] + v2.e[1], v1.e[2] + v2.e[2]); }
 inline vec3 operator-(const vec3& v1, const vec3& v2) { return vec3(v1.e[0] - v2.e[0], v1.e[1] - v2.e[1], v1.e[2] - v2.e[2]); }
 inline vec3 operator*(const vec3& v1, const vec3& v2) { return vec3(v1.e[0] * v2.e[0], v1.e[1] * v2.e[1], v1.e[2] * v2.e[2]); }
@@ -122,5 +229,7 @@ inline vec3& vec3::operator/=(const float t)
     return *this;
 }
 
+#endif  // VEC3_SSE
+
 inline vec3 unit_vector(vec3 v) { return v / v.length(); }
 #endif
\ No newline at end of file
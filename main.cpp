@@ -1,21 +1,34 @@
+#include <assert.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <chrono>
 #include <fstream>
 #include <iostream>
 
-// #include <omp.h>
 #include "float.h"
 #include "include/aarect.h"
 #include "include/box.h"
-#include "include/bvh_node.h"
+#include "include/bvh.h"
 #include "include/camera.h"
+#include "include/checkpoint.h"
 #include "include/constant_medium.h"
+#include "include/framebuffer.h"
+#include "include/heatmap.h"
 #include "include/hitablelist.h"
+#include "include/image_io.h"
+#include "include/integrator.h"
 #include "include/material.h"
+#include "include/mesh_loader.h"
 #include "include/moving_sphere.h"
 #include "include/perlin.h"
+#include "include/random.h"
+#include "include/render_stats.h"
+#include "include/scene_cache.h"
 #include "include/sphere.h"
+#include "include/tile_scheduler.h"
+#include "include/triangle_mesh.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "include/stb_image.h"
@@ -25,35 +38,256 @@
 
 #define MONITOR_TIME
 
+struct Render_options {
+    std::string scene;  // built-in scene, or a comma-separated list or "all" with --bench
+    int nx, ny;
+    int n_threads;  // 0: one per hardware thread
+    int tile_size;
+    Tile_order tile_order;
+    uint64_t seed;
+    Bvh_build_params bvh;
+    Integrator_params integrator;
+    const char* mesh_path;  // .obj or .ply shown in the Cornell box instead of its two blocks
+    Scene_cache cache;      // where loaded meshes with their BVH and decoded images are cached
+    std::string output;     // format picked from the extension
+    Heatmap_metric heatmap;  // per-pixel cost also written next to output, HEATMAP_NONE for none
+    bool async_write;
+    Tone_params tone;  // display mapping of 8-bit outputs
+    int spp;  // average samples per pixel, 0 for the scene's default
+    Adaptive_params adaptive;
+    int pass_spp;             // 0: all samples in one pass, or passes of 4 after min_spp when adaptive
+    float snapshot_interval;  // seconds between images written during the render, 0 for none
+    int snapshot_passes;      // passes between images written during the render, 0 for none
+    float time_limit;         // seconds of rendering before stopping with what is done, 0 for none
+    std::string checkpoint;   // render state file, empty for none
+    float checkpoint_interval;
+    bool resume;
+    bool bench;
+    std::vector<int> bench_threads;  // thread counts of the sweep, empty for powers of two up to the hardware's
+    bool bench_json;
+};
+
+// Set by SIGINT and SIGTERM: the render stops after the tiles in flight and writes what it has
+volatile sig_atomic_t interrupted = 0;
+
+void on_interrupt(int) { interrupted = 1; }
+
+void print_usage(const char* prog)
+{
+    std::cerr << "usage: " << prog << " [options]\n"
+              << "  --scene S         spheres | random | two_spheres | two_perlin_spheres | two_earths | simple_light |\n"
+              << "                    cornell_smoke | final | cornell (default: cornell)\n"
+              << "  --resolution W H  image size in pixels (default: 500 500)\n"
+              << "  --threads N       render and BVH build threads (default: hardware concurrency)\n"
+              << "  --tile-size N     tile edge in pixels (default: 16)\n"
+              << "  --tile-order O    scanline | spiral | hilbert (default: hilbert)\n"
+              << "  --seed N          base seed of the scene and pixel sample generators (default: 0)\n"
+              << "  --accel A         BVH layout: node | linear | bvh4 (default: node)\n"
+              << "  --bvh M           BVH split method: median | sah (default: median)\n"
+              << "  --bvh-bins N      SAH bins per axis (default: 16)\n"
+              << "  --bvh-leaf-size N largest SAH leaf (default: 4)\n"
+              << "  --bvh-costs T I   SAH traversal and intersection costs (default: 1 1)\n"
+              << "  --max-depth N     scattering events per path (default: 50)\n"
+              << "  --rr-depth N      bounces before Russian roulette may end a path (default: 3)\n"
+              << "  --mesh FILE       render an .obj or binary .ply mesh in the Cornell box\n"
+              << "  --cache DIR       reuse loaded meshes, their BVH and decoded images cached in DIR\n"
+              << "  --cache-hash      recognise cached files by hashing their content instead of by size and time\n"
+              << "  --output FILE     image file: .png, .pfm (float), .hdr (float), otherwise binary PPM (default: test.pgm)\n"
+              << "  --async-write     encode and write the image on a background thread\n"
+              << "  --heatmap M       also write each pixel's cost as <output stem>.cost.pfm and a false-colour .cost.png:\n"
+              << "                    time | rays | work (BVH nodes and primitive tests, builds with -DRENDER_STATS)\n"
+              << "  --exposure S      scale 8-bit outputs by 2^S (default: 0)\n"
+              << "  --tonemap T       8-bit tone curve: clamp | filmic (default: clamp)\n"
+              << "  --srgb            encode 8-bit outputs as sRGB instead of gamma 2\n"
+              << "  --spp N           samples per pixel, the average when adaptive (default: scene's)\n"
+              << "  --adaptive E      stop sampling pixels once their relative error is below E\n"
+              << "  --min-spp N       adaptive samples before a pixel may stop, at most spp (default: 16)\n"
+              << "  --max-spp N       adaptive samples cap per pixel (default: 8 x spp)\n"
+              << "  --pass-spp N      samples per pixel per pass (default: all at once, 4 when adaptive)\n"
+              << "  --snapshot S      also write the image every S seconds, checked between passes\n"
+              << "  --snapshot-passes K  also write the image every K passes\n"
+              << "  --time-limit S    stop after S seconds of rendering and write what is done\n"
+              << "  --checkpoint FILE save the render state to FILE between passes and when stopped early\n"
+              << "  --checkpoint-every S  seconds between checkpoints (default: 300)\n"
+              << "  --resume          continue the render saved in the --checkpoint file\n"
+              << "  --bench           render each --scene, a comma-separated list or all (the default), once per\n"
+              << "                    thread count and print timings instead of writing images\n"
+              << "  --bench-threads L comma-separated thread counts (default: 1, 2, 4... and the hardware's)\n"
+              << "  --bench-format F  csv | json (default: csv)\n";
+}
+
 /*
- * Compute final color of a pixel
+ * Splits a comma-separated list
  */
-vec3 color(const Ray& r, Hitable* world, int depth)
+std::vector<std::string> split_list(const std::string& list)
 {
-    Hit_record hrec;
-    if (world->hit(r, 0.001, FLT_MAX, hrec)) {
-        Ray scattered;
-        vec3 attenuation;
-        vec3 emitted = hrec.mat_ptr->emitted(r, hrec, hrec.u, hrec.v, hrec.p);
-        float pdf;
-        vec3 albedo;
-        if (depth < 50 && hrec.mat_ptr->scatter(r, hrec, albedo, scattered, pdf)) {
-            // return emitted + albedo * hrec.mat_ptr->scattering_pdf(r, hrec, scattered) * color(scattered, world, depth + 1) / pdf;
-            vec3 on_light = vec3(213 + drand48() * (343 - 213), 554, 227 + drand48() * (332 - 227));
-            vec3 to_light = on_light - hrec.p;
-            float distance_squared = to_light.squared_length();
-            to_light.make_unit_vector();
-            if (dot(to_light, hrec.normal) < 0) return emitted;
-            float light_area = (343 - 213) * (332 - 227);
-            float light_cosine = fabs(to_light.y());
-            if (light_cosine < 0.000001) return emitted;
-            pdf = distance_squared / (light_cosine * light_area);
-            scattered = Ray(hrec.p, to_light, r.time());
-            return emitted + albedo * hrec.mat_ptr->scattering_pdf(r, hrec, scattered) * color(scattered, world, depth + 1) / pdf;
-        } else
-            return emitted;
-    } else
-        return vec3(0, 0, 0);
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while (true) {
+        size_t end = list.find(',', begin);
+        items.push_back(list.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+        if (end == std::string::npos) break;
+        begin = end + 1;
+    }
+    return items;
+}
+
+bool parse_options(int argc, char** argv, Render_options& opts)
+{
+    opts.nx = 500;
+    opts.ny = 500;
+    opts.n_threads = 0;
+    opts.tile_size = 16;
+    opts.tile_order = TILE_ORDER_HILBERT;
+    opts.seed = 0;
+    opts.mesh_path = NULL;
+    opts.output = "test.pgm";
+    opts.async_write = false;
+    opts.heatmap = HEATMAP_NONE;
+    opts.spp = 0;
+    opts.pass_spp = 0;
+    opts.snapshot_interval = 0;
+    opts.snapshot_passes = 0;
+    opts.time_limit = 0;
+    opts.checkpoint_interval = 300;
+    opts.resume = false;
+    opts.bench = false;
+    opts.bench_json = false;
+    for (int a = 1; a < argc; a++) {
+        bool has_value = a + 1 < argc;
+        if (!strcmp(argv[a], "--scene") && has_value) {
+            opts.scene = argv[++a];
+        } else if (!strcmp(argv[a], "--resolution") && a + 2 < argc) {
+            opts.nx = atoi(argv[++a]);
+            opts.ny = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--threads") && has_value) {
+            opts.n_threads = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--tile-size") && has_value) {
+            opts.tile_size = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--tile-order") && has_value) {
+            const char* order = argv[++a];
+            if (!strcmp(order, "scanline"))
+                opts.tile_order = TILE_ORDER_SCANLINE;
+            else if (!strcmp(order, "spiral"))
+                opts.tile_order = TILE_ORDER_SPIRAL;
+            else if (!strcmp(order, "hilbert"))
+                opts.tile_order = TILE_ORDER_HILBERT;
+            else
+                return false;
+        } else if (!strcmp(argv[a], "--seed") && has_value) {
+            opts.seed = strtoull(argv[++a], NULL, 10);
+        } else if (!strcmp(argv[a], "--accel") && has_value) {
+            const char* layout = argv[++a];
+            if (!strcmp(layout, "node"))
+                opts.bvh.layout = BVH_LAYOUT_NODE;
+            else if (!strcmp(layout, "linear"))
+                opts.bvh.layout = BVH_LAYOUT_LINEAR;
+            else if (!strcmp(layout, "bvh4"))
+                opts.bvh.layout = BVH_LAYOUT_BVH4;
+            else
+                return false;
+        } else if (!strcmp(argv[a], "--bvh") && has_value) {
+            const char* method = argv[++a];
+            if (!strcmp(method, "median"))
+                opts.bvh.method = BVH_SPLIT_MEDIAN;
+            else if (!strcmp(method, "sah"))
+                opts.bvh.method = BVH_SPLIT_SAH;
+            else
+                return false;
+        } else if (!strcmp(argv[a], "--bvh-bins") && has_value) {
+            opts.bvh.n_bins = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--bvh-leaf-size") && has_value) {
+            opts.bvh.max_leaf_size = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--bvh-costs") && a + 2 < argc) {
+            opts.bvh.traversal_cost = atof(argv[++a]);
+            opts.bvh.intersection_cost = atof(argv[++a]);
+        } else if (!strcmp(argv[a], "--max-depth") && has_value) {
+            opts.integrator.max_depth = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--rr-depth") && has_value) {
+            opts.integrator.rr_min_depth = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--mesh") && has_value) {
+            opts.mesh_path = argv[++a];
+        } else if (!strcmp(argv[a], "--cache") && has_value) {
+            opts.cache.dir = argv[++a];
+        } else if (!strcmp(argv[a], "--cache-hash")) {
+            opts.cache.hash_content = true;
+        } else if (!strcmp(argv[a], "--output") && has_value) {
+            opts.output = argv[++a];
+        } else if (!strcmp(argv[a], "--async-write")) {
+            opts.async_write = true;
+        } else if (!strcmp(argv[a], "--heatmap") && has_value) {
+            const char* metric = argv[++a];
+            if (!strcmp(metric, "time"))
+                opts.heatmap = HEATMAP_TIME;
+            else if (!strcmp(metric, "rays"))
+                opts.heatmap = HEATMAP_RAYS;
+#ifdef RENDER_STATS
+            else if (!strcmp(metric, "work"))
+                opts.heatmap = HEATMAP_WORK;
+#endif
+            else
+                return false;
+        } else if (!strcmp(argv[a], "--exposure") && has_value) {
+            opts.tone.exposure = atof(argv[++a]);
+        } else if (!strcmp(argv[a], "--tonemap") && has_value) {
+            const char* curve = argv[++a];
+            if (!strcmp(curve, "clamp"))
+                opts.tone.curve = TONE_CLAMP;
+            else if (!strcmp(curve, "filmic"))
+                opts.tone.curve = TONE_FILMIC;
+            else
+                return false;
+        } else if (!strcmp(argv[a], "--srgb")) {
+            opts.tone.transfer = TRANSFER_SRGB;
+        } else if (!strcmp(argv[a], "--spp") && has_value) {
+            opts.spp = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--adaptive") && has_value) {
+            opts.adaptive.target_error = atof(argv[++a]);
+        } else if (!strcmp(argv[a], "--min-spp") && has_value) {
+            opts.adaptive.min_spp = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--max-spp") && has_value) {
+            opts.adaptive.max_spp = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--pass-spp") && has_value) {
+            opts.pass_spp = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--snapshot") && has_value) {
+            opts.snapshot_interval = atof(argv[++a]);
+        } else if (!strcmp(argv[a], "--snapshot-passes") && has_value) {
+            opts.snapshot_passes = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "--time-limit") && has_value) {
+            opts.time_limit = atof(argv[++a]);
+        } else if (!strcmp(argv[a], "--checkpoint") && has_value) {
+            opts.checkpoint = argv[++a];
+        } else if (!strcmp(argv[a], "--checkpoint-every") && has_value) {
+            opts.checkpoint_interval = atof(argv[++a]);
+        } else if (!strcmp(argv[a], "--resume")) {
+            opts.resume = true;
+        } else if (!strcmp(argv[a], "--bench")) {
+            opts.bench = true;
+        } else if (!strcmp(argv[a], "--bench-threads") && has_value) {
+            std::vector<std::string> counts = split_list(argv[++a]);
+            opts.bench_threads.clear();
+            for (size_t k = 0; k < counts.size(); k++) {
+                int n = atoi(counts[k].c_str());
+                if (n < 1) return false;
+                opts.bench_threads.push_back(n);
+            }
+        } else if (!strcmp(argv[a], "--bench-format") && has_value) {
+            const char* format = argv[++a];
+            if (!strcmp(format, "csv"))
+                opts.bench_json = false;
+            else if (!strcmp(format, "json"))
+                opts.bench_json = true;
+            else
+                return false;
+        } else {
+            return false;
+        }
+    }
+    if (opts.scene.empty()) opts.scene = opts.bench ? "all" : "cornell";
+    return opts.nx > 0 && opts.ny > 0 && opts.n_threads >= 0 && opts.tile_size > 0 && opts.bvh.n_bins > 1 && opts.bvh.max_leaf_size > 0 &&
+           opts.integrator.max_depth >= 0 && opts.integrator.rr_min_depth >= 0 && opts.spp >= 0 && opts.adaptive.target_error >= 0 &&
+           opts.adaptive.min_spp > 0 && opts.adaptive.max_spp >= 0 && opts.pass_spp >= 0 && opts.snapshot_interval >= 0 &&
+           opts.snapshot_passes >= 0 && opts.time_limit >= 0 && opts.checkpoint_interval >= 0 && (!opts.resume || !opts.checkpoint.empty());
 }
 
 Hitable* random_scene()
@@ -66,16 +300,16 @@ Hitable* random_scene()
     int i = 1;
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
-            float choose_mat = drand48();
-            vec3 center(a + 0.9 * drand48(), 0.2, b + 0.9 * drand48());
+            float choose_mat = random_float();
+            vec3 center(a + 0.9 * random_float(), 0.2, b + 0.9 * random_float());
             if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
                 if (choose_mat < 0.8) {  // diffuse
                     list[i++] = new Moving_sphere(
-                        center, center + vec3(0, 0.5 * drand48(), 0), 0.0, 1.0, 0.2,
-                        new Lambertian(new Constant_texture(vec3(drand48() * drand48(), drand48() * drand48(), drand48() * drand48()))));
+                        center, center + vec3(0, 0.5 * random_float(), 0), 0.0, 1.0, 0.2,
+                        new Lambertian(new Constant_texture(vec3(random_float() * random_float(), random_float() * random_float(), random_float() * random_float()))));
                 } else if (choose_mat < 0.95) {  // metal
                     list[i++] = new Sphere(center, 0.2,
-                                           new Metal(vec3(0.5 * (1 + drand48()), 0.5 * (1 + drand48()), 0.5 * (1 + drand48())), 0.5 * drand48()));
+                                           new Metal(vec3(0.5 * (1 + random_float()), 0.5 * (1 + random_float()), 0.5 * (1 + random_float())), 0.5 * random_float()));
                 } else {  // glass
                     list[i++] = new Sphere(center, 0.2, new Dielectric(1.5));
                 }
@@ -110,11 +344,26 @@ Hitable* two_perlin_spheres()
     return new Hitable_list(list, 2);
 }
 
-Hitable* two_earths()
+/*
+ * Loads path with stbi_load, going through the decoded image cache when there is one
+ */
+unsigned char* load_image(const char* path, const Scene_cache& cache, int* nx, int* ny, int* nn)
+{
+    uint64_t key;
+    if (!cache.dir || !source_file_key(path, cache.hash_content, key)) return stbi_load(path, nx, ny, nn, 0);
+    std::string cache_file = cache_file_name(cache.dir, path, ".image");
+    unsigned char* pixels = read_image_cache(cache_file, key, nx, ny, nn);
+    if (pixels) return pixels;
+    pixels = stbi_load(path, nx, ny, nn, 0);
+    if (pixels && !write_image_cache(cache_file, key, pixels, *nx, *ny, *nn)) std::cerr << "cannot write " << cache_file << "\n";
+    return pixels;
+}
+
+Hitable* two_earths(const Scene_cache& cache)
 {
     int nx, ny, nn;
 
-    unsigned char* pixels = stbi_load("assets/earth.jpg", &nx, &ny, &nn, 0);
+    unsigned char* pixels = load_image("assets/earth.jpg", cache, &nx, &ny, &nn);
 
     Texture* earth_tex = new Image_texture(pixels, nx, ny);
 
@@ -146,7 +395,7 @@ Hitable* cornell_box()
     // Add walls and ceil light
     list[i++] = new Flip_normals(new YZ_rect(0, 555, 0, 555, 555, green));
     list[i++] = new YZ_rect(0, 555, 0, 555, 0, red);
-    list[i++] = new XZ_rect(213, 343, 227, 332, 554, light);
+    list[i++] = new Flip_normals(new XZ_rect(213, 343, 227, 332, 554, light));
     list[i++] = new Flip_normals(new XZ_rect(0, 555, 0, 555, 555, white));
     list[i++] = new XZ_rect(0, 555, 0, 555, 0, white);
     list[i++] = new Flip_normals(new XY_rect(0, 555, 0, 555, 555, white));
@@ -164,7 +413,7 @@ Hitable* cornell_box()
     return new Hitable_list(list, i);
 }
 
-Hitable* cornell_box(Hitable** scene, Camera** cam, float aspect)
+void cornell_box(Hitable** scene, Camera** cam, float aspect)
 {
     int i = 0;
     Hitable** list = new Hitable*[8];
@@ -175,7 +424,7 @@ Hitable* cornell_box(Hitable** scene, Camera** cam, float aspect)
     // Add walls and ceil light
     list[i++] = new Flip_normals(new YZ_rect(0, 555, 0, 555, 555, green));
     list[i++] = new YZ_rect(0, 555, 0, 555, 0, red);
-    list[i++] = new XZ_rect(213, 343, 227, 332, 554, light);
+    list[i++] = new Flip_normals(new XZ_rect(213, 343, 227, 332, 554, light));
     list[i++] = new Flip_normals(new XZ_rect(0, 555, 0, 555, 555, white));
     list[i++] = new XZ_rect(0, 555, 0, 555, 0, white);
     list[i++] = new Flip_normals(new XY_rect(0, 555, 0, 555, 555, white));
@@ -193,7 +442,65 @@ Hitable* cornell_box(Hitable** scene, Camera** cam, float aspect)
     *cam = new Camera(lookfrom, lookat, vec3(0, 1, 0), vfov, aspect, aperture, dist_to_focus, 0.0, 1.0);
 }
 
-Hitable* final_scene()
+/*
+ * Cornell box whose two blocks are replaced by a mesh loaded from disk, scaled to stand in the middle.
+ * With a cache, the scaled mesh and its BVH are reused from there while the file is unchanged.
+ */
+bool mesh_scene(const char* path, const Scene_cache& cache, const Bvh_build_params& bvh, Hitable** scene, Camera** cam, float aspect)
+{
+#ifdef MONITOR_TIME
+    std::chrono::time_point<std::chrono::high_resolution_clock> start = std::chrono::high_resolution_clock::now();
+#endif
+    Material* red = new Lambertian(new Constant_texture(vec3(0.65, 0.05, 0.05)));
+    Material* white = new Lambertian(new Constant_texture(vec3(0.73, 0.73, 0.73)));
+    Material* green = new Lambertian(new Constant_texture(vec3(0.12, 0.45, 0.15)));
+    Material* light = new Diffuse_light(new Constant_texture(vec3(15, 15, 15)));
+
+    const float fit[4] = { 278, 0, 278, 330 };
+    Triangle_mesh* mesh = NULL;
+    std::string cache_file;
+    uint64_t key = 0;
+    if (cache.dir && source_file_key(path, cache.hash_content, key)) {
+        key = hash_bytes(fit, sizeof(fit), hash_bvh_params(bvh, key));
+        cache_file = cache_file_name(cache.dir, path, ".mesh");
+        mesh = read_mesh_cache(cache_file, key, white);
+    }
+    bool cached = mesh != NULL;
+    if (!mesh) {
+        Mesh_data data;
+        if (!load_mesh(path, data, bvh.n_threads)) return false;
+        if (data.indices.empty()) {
+            std::cerr << path << ": no triangles\n";
+            return false;
+        }
+        fit_mesh(data, vec3(fit[0], fit[1], fit[2]), fit[3]);
+        mesh = new Triangle_mesh(std::move(data.positions), std::move(data.indices), white, std::move(data.normals), std::move(data.uvs), bvh);
+        if (!cache_file.empty() && !write_mesh_cache(cache_file, key, *mesh)) std::cerr << "cannot write " << cache_file << "\n";
+    }
+#ifdef MONITOR_TIME
+    std::chrono::time_point<std::chrono::high_resolution_clock> end = std::chrono::high_resolution_clock::now();
+    std::cout << "---MESH LOAD TIME--- : " << std::chrono::duration<float>(end - start).count() << "s (" << mesh->positions.size()
+              << " vertices, " << mesh->triangle_count() << " triangles" << (cached ? ", cached" : "") << ")" << std::endl;
+#endif
+
+    int i = 0;
+    Hitable** list = new Hitable*[7];
+    list[i++] = new Flip_normals(new YZ_rect(0, 555, 0, 555, 555, green));
+    list[i++] = new YZ_rect(0, 555, 0, 555, 0, red);
+    list[i++] = new Flip_normals(new XZ_rect(213, 343, 227, 332, 554, light));
+    list[i++] = new Flip_normals(new XZ_rect(0, 555, 0, 555, 555, white));
+    list[i++] = new XZ_rect(0, 555, 0, 555, 0, white);
+    list[i++] = new Flip_normals(new XY_rect(0, 555, 0, 555, 555, white));
+    list[i++] = mesh;
+
+    *scene = new Hitable_list(list, i);
+    vec3 lookfrom(278, 278, -800);
+    vec3 lookat(278, 278, 0);
+    *cam = new Camera(lookfrom, lookat, vec3(0, 1, 0), 40, aspect, 0.0, 10.0, 0.0, 1.0);
+    return true;
+}
+
+Hitable* final_scene(const Bvh_build_params& bvh, const Scene_cache& cache)
 {
     int nb = 20;
     Hitable** list = new Hitable*[30];
@@ -212,17 +519,17 @@ Hitable* final_scene()
             float y0 = 0;
             float z0 = -1000 + j * w;
             float x1 = x0 + w;
-            float y1 = 100 * (drand48() + 0.01);
+            float y1 = 100 * (random_float() + 0.01);
             float z1 = z0 + w;
             boxlist[b++] = new Box(vec3(x0, y0, z0), vec3(x1, y1, z1), ground);
         }
     }
     int l = 0;
-    list[l++] = new Bvh_node(boxlist, b, 0, 1);
+    list[l++] = make_bvh(boxlist, b, 0, 1, bvh);
 
     // The rest
     Material* light = new Diffuse_light(new Constant_texture(vec3(7, 7, 7)));
-    list[l++] = new XZ_rect(123, 423, 147, 412, 554, light);
+    list[l++] = new Flip_normals(new XZ_rect(123, 423, 147, 412, 554, light));
     vec3 center(400, 400, 200);
     list[l++] = new Moving_sphere(center, center + vec3(30, 0, 0), 0, 1, 50, new Lambertian(new Constant_texture(vec3(0.7, 0.3, 0.1))));
     list[l++] = new Sphere(vec3(260, 150, 45), 50, new Dielectric(1.5));
@@ -235,7 +542,7 @@ Hitable* final_scene()
     list[l++] = new Constant_medium(boundary, 0.0001, new Constant_texture(vec3(1.0, 1.0, 1.0)));
 
     int nx, ny, nn;
-    unsigned char* tex_data = stbi_load("assets/earth.jpg", &nx, &ny, &nn, 0);
+    unsigned char* tex_data = load_image("assets/earth.jpg", cache, &nx, &ny, &nn);
     Material* emat = new Lambertian(new Image_texture(tex_data, nx, ny));
     list[l++] = new Sphere(vec3(400, 200, 400), 100, emat);
     Texture* pertext = new Noise_texture(0.1);
@@ -243,173 +550,412 @@ Hitable* final_scene()
 
     int ns = 1000;
     for (int j = 0; j < ns; j++) {
-        boxlist2[j] = new Sphere(vec3(165 * drand48(), 165 * drand48(), 165 * drand48()), 10, white);
+        boxlist2[j] = new Sphere(vec3(165 * random_float(), 165 * random_float(), 165 * random_float()), 10, white);
     }
-    list[l++] = new Translate(new Rotate_y(new Bvh_node(boxlist2, ns, 0.0, 1.0), 15), vec3(-100, 270, 395));
+    list[l++] = new Translate(new Rotate_y(make_bvh(boxlist2, ns, 0.0, 1.0, bvh), 15), vec3(-100, 270, 395));
     return new Hitable_list(list, l);
 }
-int main()
-{
-#if 1
-    int nx = 500;
-    int ny = 500;
-    int ns = 10;
-#else
-    int nx = 1920;  // 1200;
-    int ny = 1080;  // 600;
-    int ns = 20;    // 200;
 
-#endif
+const char* scene_names[] = { "spheres", "random", "two_spheres", "two_perlin_spheres", "two_earths", "simple_light", "cornell_smoke", "final", "cornell" };
+const int n_scene_names = sizeof(scene_names) / sizeof(scene_names[0]);
 
-#if 0
-    Hitable* list[5];
-    float t0 = 0.0;
-    float t1 = 1.0;
-    vec3 center(0, 0, -1);
-    list[0] = new Moving_sphere(center, center + vec3(0, 0.2, 0), t0, t1, 0.5, new Lambertian(new Constant_texture(vec3(0.1, 0.2, 0.5))));
-    // list[0] = new Sphere(vec3(0, 0, -1), 0.5, new Lambertian(new Constant_texture( vec3(0.1, 0.2, 0.5))));
-    list[1] = new Sphere(vec3(0, -100.5, -1), 100, new Lambertian(new Constant_texture(vec3(0.8, 0.8, 0.0))));
-    list[2] = new Sphere(vec3(-1, 0, -1), 0.5, new Metal(vec3(0.8, 0.6, 0.2), 0.1));
-    list[3] = new Sphere(vec3(1, 0, -1), 0.5, new Dielectric(1.5));
-    list[4] = new Sphere(vec3(1, 0, -1), -0.45, new Dielectric(1.5));
-    Hitable* world = new Hitable_list(list, 5);
-
-    vec3 lookfrom(3, 3, 2);
-    vec3 lookat(0, 0, -1);
-    float dist_to_focus = (lookfrom - lookat).length();
-    float aperture = 0.1;
-    Camera cam(lookfrom, lookat, vec3(0, 1, 0), 20, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 0.1);
-#elif 0
-    Hitable* world = random_scene();
-
-    vec3 lookfrom(13, 2, 3);
-    vec3 lookat(0, 0, 0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.1;
-    Camera cam(lookfrom, lookat, vec3(0, 1, 0), 20, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
-#elif 0
-    Hitable* world = two_spheres();
-
-    vec3 lookfrom(13, 2, 3);
-    vec3 lookat(0, 0, 0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.0;
-    Camera cam(lookfrom, lookat, vec3(0, 1, 0), 20, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
+/*
+ * Builds the built-in scene called name and its camera for images of the given aspect ratio. The
+ * cornell scene shows opts.mesh_path instead of its two blocks when there is one.
+ */
+bool build_scene(const std::string& name, const Render_options& opts, float aspect, Hitable** world, Camera** cam)
+{
+    if (name == "spheres") {
+        Hitable** list = new Hitable*[5];
+        float t0 = 0.0;
+        float t1 = 1.0;
+        vec3 center(0, 0, -1);
+        list[0] = new Moving_sphere(center, center + vec3(0, 0.2, 0), t0, t1, 0.5, new Lambertian(new Constant_texture(vec3(0.1, 0.2, 0.5))));
+        list[1] = new Sphere(vec3(0, -100.5, -1), 100, new Lambertian(new Constant_texture(vec3(0.8, 0.8, 0.0))));
+        list[2] = new Sphere(vec3(-1, 0, -1), 0.5, new Metal(vec3(0.8, 0.6, 0.2), 0.1));
+        list[3] = new Sphere(vec3(1, 0, -1), 0.5, new Dielectric(1.5));
+        list[4] = new Sphere(vec3(1, 0, -1), -0.45, new Dielectric(1.5));
+        *world = new Hitable_list(list, 5);
+
+        vec3 lookfrom(3, 3, 2);
+        vec3 lookat(0, 0, -1);
+        float dist_to_focus = (lookfrom - lookat).length();
+        float aperture = 0.1;
+        *cam = new Camera(lookfrom, lookat, vec3(0, 1, 0), 20, aspect, aperture, dist_to_focus, 0.0, 0.1);
+    } else if (name == "random") {
+        *world = random_scene();
+
+        vec3 lookfrom(13, 2, 3);
+        vec3 lookat(0, 0, 0);
+        float dist_to_focus = 10.0;
+        float aperture = 0.1;
+        *cam = new Camera(lookfrom, lookat, vec3(0, 1, 0), 20, aspect, aperture, dist_to_focus, 0.0, 1.0);
+    } else if (name == "two_spheres" || name == "two_perlin_spheres" || name == "two_earths") {
+        if (name == "two_spheres")
+            *world = two_spheres();
+        else if (name == "two_perlin_spheres")
+            *world = two_perlin_spheres();
+        else
+            *world = two_earths(opts.cache);
+
+        vec3 lookfrom(13, 2, 3);
+        vec3 lookat(0, 0, 0);
+        float dist_to_focus = 10.0;
+        float aperture = 0.0;
+        *cam = new Camera(lookfrom, lookat, vec3(0, 1, 0), 20, aspect, aperture, dist_to_focus, 0.0, 1.0);
+    } else if (name == "simple_light") {
+        *world = simple_light();
+
+        vec3 lookfrom(13, 2, 3);
+        vec3 lookat(0, 1, 0);
+        float dist_to_focus = 10.0;
+        float aperture = 0.0;
+        *cam = new Camera(lookfrom, lookat, vec3(0, 1.5, 0), 40, aspect, aperture, dist_to_focus, 0.0, 1.0);
+    } else if (name == "cornell_smoke" || name == "final") {
+        *world = name == "final" ? final_scene(opts.bvh, opts.cache) : cornell_box();
+        vec3 lookfrom(278, 278, -800);
+        vec3 lookat(278, 278, 0);
+        float dist_to_focus = 10.0;
+        float aperture = 0.0;
+        float vfov = 35;
+        *cam = new Camera(lookfrom, lookat, vec3(0, 1, 0), vfov, aspect, aperture, dist_to_focus, 0.0, 1.0);
+    } else if (name == "cornell") {
+        if (opts.mesh_path) return mesh_scene(opts.mesh_path, opts.cache, opts.bvh, world, cam, aspect);
+        cornell_box(world, cam, aspect);
+    } else {
+        std::cerr << "unknown scene " << name << "\n";
+        return false;
+    }
+    return true;
+}
 
-#elif 0
-    Hitable* world = two_perlin_spheres();
+/*
+ * Takes pixel (i, j) of film from the samples it has to n_samples. Returns the rays traced.
+ */
+long sample_pixel(Framebuffer& film, int i, int j, int n_samples, Camera* cam, Hitable* world, const Hitable* lights, const Render_options& opts)
+{
+    long n_rays = 0;
+    for (int s = film.at(i, j).n; s < n_samples; s++) {
+        seed_pixel_sample(opts.seed, i, j, s);
+        float u = float(i + random_float()) / float(film.nx);
+        float v = float(j + random_float()) / float(film.ny);
+        Ray r = cam->get_ray(u, v);
+        film.add_sample(i, j, trace_path(r, world, lights, opts.integrator, n_rays));
+    }
+    return n_rays;
+}
 
-    vec3 lookfrom(13, 2, 3);
-    vec3 lookat(0, 0, 0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.0;
-    Camera cam(lookfrom, lookat, vec3(0, 1, 0), 20, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
-#elif 0
-    Hitable* world = two_earths();
+// Emitters, which the integrator samples directly; NULL when the scene has none
+Hitable* collect_scene_lights(Hitable* world, std::vector<Hitable*>& light_list)
+{
+    world->collect_lights(light_list);
+    return light_list.empty() ? NULL : new Hitable_list(&light_list[0], int(light_list.size()));
+}
+/*
+ * Key of the checkpoints of a render: a hash of every setting that changes its pixels, and of the mesh
+ * file's key as the mesh cache computes it, so editing the mesh also invalidates the checkpoints
+ */
+uint64_t render_key(const Render_options& opts, int nx, int ny, int ns, int max_spp, int pass_spp)
+{
+    double values[10] = { double(nx),
+                          double(ny),
+                          double(ns),
+                          double(max_spp),
+                          double(pass_spp),
+                          double(opts.integrator.max_depth),
+                          double(opts.integrator.rr_min_depth),
+                          opts.adaptive.target_error,
+                          double(opts.adaptive.min_spp),
+                          double(opts.bvh.layout) };
+    uint64_t key = hash_bvh_params(opts.bvh, hash_bytes(values, sizeof(values), opts.seed));
+    key = hash_bytes(opts.scene.data(), opts.scene.size(), key);
+    if (opts.mesh_path) {
+        uint64_t mesh_key;
+        if (source_file_key(opts.mesh_path, opts.cache.hash_content, mesh_key)) key = mix_bits(key ^ mesh_key);
+        key = hash_bytes(opts.mesh_path, strlen(opts.mesh_path), key);
+    }
+    return key;
+}
 
-    vec3 lookfrom(13, 2, 3);
-    vec3 lookat(0, 0, 0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.0;
-    Camera cam(lookfrom, lookat, vec3(0, 1, 0), 20, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
-#elif 0
-    Hitable* world = simple_light();
+struct Bench_run {
+    std::string scene;
+    int n_threads;
+    double build_time;  // seconds to build the scene, BVHs and textures included
+    double render_time;
+    long n_rays;
+    long n_samples;
+    long peak_rss;  // kilobytes, of the whole process so far
+};
+
+long peak_rss_kb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss;  // kilobytes on Linux
+}
 
-    vec3 lookfrom(13, 2, 3);
-    vec3 lookat(0, 1, 0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.0;
-    Camera cam(lookfrom, lookat, vec3(0, 1.5, 0), 40, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
-#elif 0
-    Hitable* world = cornell_box();
-    vec3 lookfrom(278, 278, -800);
-    vec3 lookat(278, 278, 0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.0;
-    float vfov = 35;
+void print_bench_report(const std::vector<Bench_run>& runs, const Render_options& opts, int ns)
+{
+    if (!opts.bench_json) printf("scene,threads,width,height,spp,build_s,render_s,mrays_per_s,samples_per_s,peak_rss_mb,efficiency\n");
+    if (opts.bench_json) printf("{\n  \"seed\": %llu,\n  \"runs\": [\n", (unsigned long long)opts.seed);
+    size_t base = 0;
+    for (size_t k = 0; k < runs.size(); k++) {
+        const Bench_run& r = runs[k];
+        // Runs of a scene are consecutive, fewest threads first
+        if (k == 0 || r.scene != runs[k - 1].scene) base = k;
+        double efficiency = runs[base].render_time * runs[base].n_threads / (r.render_time * r.n_threads);
+        double mrays = r.n_rays / r.render_time * 1e-6;
+        double samples = r.n_samples / r.render_time;
+        if (opts.bench_json) {
+            printf("    {\"scene\": \"%s\", \"threads\": %d, \"width\": %d, \"height\": %d, \"spp\": %d, \"build_s\": %.4f, \"render_s\": %.4f, "
+                   "\"mrays_per_s\": %.4f, \"samples_per_s\": %.1f, \"peak_rss_mb\": %.1f, \"efficiency\": %.4f}%s\n",
+                   r.scene.c_str(), r.n_threads, opts.nx, opts.ny, ns, r.build_time, r.render_time, mrays, samples, r.peak_rss / 1024.0, efficiency,
+                   k + 1 < runs.size() ? "," : "");
+        } else {
+            printf("%s,%d,%d,%d,%d,%.4f,%.4f,%.4f,%.1f,%.1f,%.4f\n", r.scene.c_str(), r.n_threads, opts.nx, opts.ny, ns, r.build_time, r.render_time, mrays,
+                   samples, r.peak_rss / 1024.0, efficiency);
+        }
+    }
+    if (opts.bench_json) printf("  ]\n}\n");
+}
 
-    Camera cam(lookfrom, lookat, vec3(0, 1, 0), vfov, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
-#elif 0
-    Hitable* world = final_scene();
-    vec3 lookfrom(278, 278, -800);
-    vec3 lookat(278, 278, 0);
-    float dist_to_focus = 10.0;
-    float aperture = 0.0;
-    float vfov = 35;
+/*
+ * Renders each scene of opts.scene with ns samples per pixel once per thread count of the sweep and
+ * prints a report on stdout. A scene is built once for all its runs. Scenes are never freed, so the
+ * peak RSS of a scene includes the ones before it: benchmark one per process to isolate it. Parallel
+ * efficiency is relative to the scene's run with the fewest threads.
+ */
+int run_benchmark(const Render_options& opts, int ns)
+{
+    std::vector<std::string> names;
+    if (opts.scene == "all")
+        names.assign(scene_names, scene_names + n_scene_names);
+    else
+        names = split_list(opts.scene);
+    std::vector<int> counts = opts.bench_threads;
+    if (counts.empty()) {
+        int n_hw = std::max(1, int(std::thread::hardware_concurrency()));
+        for (int n = 1; n < n_hw; n *= 2) counts.push_back(n);
+        counts.push_back(n_hw);
+    }
+    std::sort(counts.begin(), counts.end());
+    counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+
+    typedef std::chrono::steady_clock Clock;
+    std::vector<Bench_run> runs;
+    for (size_t k = 0; k < names.size(); k++) {
+        thread_rng().seed(opts.seed, 0);
+        Clock::time_point start = Clock::now();
+        Hitable* world;
+        Camera* cam;
+        if (!build_scene(names[k], opts, float(opts.nx) / float(opts.ny), &world, &cam)) return 1;
+        std::vector<Hitable*> light_list;
+        Hitable* lights = collect_scene_lights(world, light_list);
+        double build_time = std::chrono::duration<double>(Clock::now() - start).count();
+
+        for (size_t c = 0; c < counts.size(); c++) {
+            std::cerr << names[k] << ": " << counts[c] << " threads\n";
+            Framebuffer film(opts.nx, opts.ny);
+            Tile_scheduler scheduler(opts.nx, opts.ny, opts.tile_size, opts.tile_order, counts[c]);
+            std::vector<long> thread_rays(scheduler.n_threads, 0);
+            start = Clock::now();
+            scheduler.run([&](const Tile& tile, int thread_id) {
+                long n_rays = 0;
+                for (int j = tile.y0; j < tile.y1; j++)
+                    for (int i = tile.x0; i < tile.x1; i++) n_rays += sample_pixel(film, i, j, ns, cam, world, lights, opts);
+                thread_rays[thread_id] += n_rays;
+            });
+            Bench_run run;
+            run.render_time = std::chrono::duration<double>(Clock::now() - start).count();
+            run.scene = names[k];
+            run.n_threads = counts[c];
+            run.build_time = build_time;
+            run.n_rays = 0;
+            for (size_t t = 0; t < thread_rays.size(); t++) run.n_rays += thread_rays[t];
+            run.n_samples = film.total_samples();
+            run.peak_rss = peak_rss_kb();
+            runs.push_back(run);
+        }
+    }
+    print_bench_report(runs, opts, ns);
+    return 0;
+}
 
-    Camera cam(lookfrom, lookat, vec3(0, 1, 0), vfov, float(nx) / float(ny), aperture, dist_to_focus, 0.0, 1.0);
+int main(int argc, char** argv)
+{
+    Render_options opts;
+    if (!parse_options(argc, argv, opts)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    thread_rng().seed(opts.seed, 0);
+    Bvh_build_stats bvh_stats;
+    opts.bvh.stats = &bvh_stats;
+    opts.bvh.n_threads = opts.n_threads;
 
-#else
+    int nx = opts.nx;
+    int ny = opts.ny;
+    int ns = opts.spp > 0 ? opts.spp : 10;
+    if (opts.bench) return run_benchmark(opts, ns);
 
     Hitable* world;
     Camera* cam;
-    cornell_box(&world, &cam, float(nx) / float(ny));
+    if (!build_scene(opts.scene, opts, float(nx) / float(ny), &world, &cam)) return 1;
+    std::vector<Hitable*> light_list;
+    Hitable* lights = collect_scene_lights(world, light_list);
 
+#ifdef MONITOR_TIME
+    if (bvh_stats.n_builds > 0) print_bvh_stats(std::cout, bvh_stats);
+    std::cout << "---LIGHTS--- : " << light_list.size() << std::endl;
 #endif
 
-    int size_img_tab = 3 * nx * ny;
-
-    int* img_tab = new int[size_img_tab];
-    memset(img_tab, 0, size_img_tab);
+    bool adaptive = opts.adaptive.target_error > 0;
+    // The first adaptive pass gives every pixel min_spp samples, so it must fit in the budget of ns per
+    // pixel: past it, keep_noisiest would have no error estimates to rank pixels by
+    opts.adaptive.min_spp = std::min(opts.adaptive.min_spp, ns);
+    int max_spp = !adaptive ? ns : opts.adaptive.max_spp > 0 ? opts.adaptive.max_spp : 8 * ns;
+    Framebuffer film(nx, ny);
+    Image image(nx, ny);
+    Image_format format = image_format_from_name(opts.output);
+    Image_writer writer(opts.async_write, opts.tone);
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point render_start = Clock::now();
+    Clock::time_point last_snapshot = render_start;
+    Clock::time_point deadline = render_start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(opts.time_limit));
+    std::function<bool()> out_of_time = [&]() { return interrupted || (opts.time_limit > 0 && Clock::now() >= deadline); };
+    signal(SIGINT, on_interrupt);
+    signal(SIGTERM, on_interrupt);
 
 #ifdef MONITOR_TIME
     std::chrono::time_point<std::chrono::high_resolution_clock> start, end;
     start = std::chrono::high_resolution_clock::now();
 #endif
-    int jref = 0;
-
-#pragma omp parallel for collapse(2) num_threads(4)
-    for (int j = ny - 1; j >= 0; j--) {
-        for (int i = 0; i < nx; i++) {
-            vec3 col(0, 0, 0);
-            for (int s = 0; s < ns; s++) {
-                float u = float(i + drand48()) / float(nx);
-                float v = float(j + drand48()) / float(ny);
-                Ray r = cam->get_ray(u, v);
-                vec3 p = r.point_at_parameter(2.0);
-                // #pragma omp critical
-                {
-                    col += color(r, world, 0);
-                }
-            }
-            col /= float(ns);
-            col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
-            int ir = int(255.99 * col[0]);
-            int ig = int(255.99 * col[1]);
-            int ib = int(255.99 * col[2]);
-            // file_pgm << ir << " " << ig << " " << ib << "\n";
-
-            int jj = -j + ny - 1;
-            int ii = i;
-            int index = 3 * (jj * nx + ii);
-            img_tab[index] = ir;
-            img_tab[index + 1] = ig;
-            img_tab[index + 2] = ib;
-
-        }  // i
-    }      // j
+
+    // Passes over the active pixels until the budget of ns samples per pixel is spent. Samples are
+    // numbered per pixel, so a pixel's estimate does not depend on the pass or thread that took it,
+    // and a pass cut short by the time limit leaves every pixel with a valid mean.
+    Tile_scheduler scheduler(nx, ny, opts.tile_size, opts.tile_order, opts.n_threads);
+    std::vector<unsigned char> active(size_t(nx) * ny, 1);
+    std::vector<long> thread_rays(scheduler.n_threads, 0);
+    Cost_map costs(opts.heatmap != HEATMAP_NONE ? nx : 0, opts.heatmap != HEATMAP_NONE ? ny : 0);
+    int later_pass_spp = opts.pass_spp > 0 ? opts.pass_spp : adaptive ? 4 : ns;
+    Render_progress progress;
+    progress.budget = long(ns) * nx * ny;
+    progress.pass_end = std::min(adaptive ? opts.adaptive.min_spp : later_pass_spp, max_spp);
+
+    uint64_t key = render_key(opts, nx, ny, ns, max_spp, later_pass_spp);
+    if (opts.resume) {
+        if (!read_checkpoint(opts.checkpoint, key, film, active, progress)) {
+            std::cerr << "cannot resume from " << opts.checkpoint << ": missing or written with other settings\n";
+            return 1;
+        }
+    }
+    Clock::time_point last_checkpoint = Clock::now();
+    long n_active = 0;
+    for (size_t k = 0; k < active.size(); k++) n_active += active[k];
+
+    bool stopped = false;
+    scheduler.reset();
+    while (n_active > 0) {
+        if (!progress.in_pass) {
+            long pass_samples = long(progress.pass_end - progress.pass_begin);
+            if (adaptive && n_active * pass_samples > progress.budget) n_active = keep_noisiest(film, progress.budget / pass_samples, active);
+            if (n_active == 0) break;
+            progress.in_pass = true;
+        }
+        scheduler.run([&](const Tile& tile, int thread_id) {
+            if (out_of_time()) return;
+            long n_rays = 0;
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    if (!active[size_t(j) * nx + i]) continue;
+                    if (opts.heatmap == HEATMAP_NONE) {
+                        n_rays += sample_pixel(film, i, j, progress.pass_end, cam, world, lights, opts);
+                        continue;
+                    }
+                    Clock::time_point pixel_start = Clock::now();
+                    uint64_t work = thread_traversal_work();
+                    long pixel_rays = sample_pixel(film, i, j, progress.pass_end, cam, world, lights, opts);
+                    n_rays += pixel_rays;
+                    if (opts.heatmap == HEATMAP_TIME)
+                        costs.add(i, j, std::chrono::duration<double>(Clock::now() - pixel_start).count());
+                    else if (opts.heatmap == HEATMAP_RAYS)
+                        costs.add(i, j, double(pixel_rays));
+                    else
+                        costs.add(i, j, double(thread_traversal_work() - work));
+                }  // i
+            }      // j
+            thread_rays[thread_id] += n_rays;
+        });
+        if (out_of_time()) {
+            stopped = true;
+            break;
+        }
+        progress.budget -= n_active * (progress.pass_end - progress.pass_begin);
+        progress.n_passes++;
+        progress.in_pass = false;
+        progress.pass_begin = progress.pass_end;
+        progress.pass_end = std::min(progress.pass_end + later_pass_spp, max_spp);
+        n_active = retire_converged(film, opts.adaptive, max_spp, active);
+        if (n_active == 0) break;
+
+        bool snapshot = (opts.snapshot_passes > 0 && progress.n_passes % opts.snapshot_passes == 0) ||
+                        (opts.snapshot_interval > 0 && std::chrono::duration<double>(Clock::now() - last_snapshot).count() >= opts.snapshot_interval);
+        if (snapshot) {
+            film.resolve(image);
+            writer.write(opts.output, format, image);
+            last_snapshot = Clock::now();
+        }
+        if (!opts.checkpoint.empty() && std::chrono::duration<double>(Clock::now() - last_checkpoint).count() >= opts.checkpoint_interval) {
+            if (!write_checkpoint(opts.checkpoint, key, film, active, progress)) std::cerr << "cannot write " << opts.checkpoint << "\n";
+            last_checkpoint = Clock::now();
+        }
+    }
+    if (stopped && !opts.checkpoint.empty() && !write_checkpoint(opts.checkpoint, key, film, active, progress))
+        std::cerr << "cannot write " << opts.checkpoint << "\n";
+    assert(stopped || film.unsampled_pixels() == 0);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    film.resolve(image);
 
 #ifdef MONITOR_TIME
     end = std::chrono::high_resolution_clock::now();
     std::cout << "---TOTAL RENDERING TIME--- : " << std::chrono::duration<float>(end - start).count() << "s" << std::endl;
+    long n_rays = 0;
+    for (size_t t = 0; t < thread_rays.size(); t++) n_rays += thread_rays[t];
+    std::cout << "---RAYS--- : " << n_rays << " (" << n_rays / std::chrono::duration<double>(end - start).count() * 1e-6 << " Mrays/s)" << std::endl;
+    std::cout << "---SAMPLES--- : " << double(film.total_samples()) / (double(nx) * ny) << " spp in " << progress.n_passes << " passes"
+              << (stopped ? interrupted ? ", interrupted" : ", time limit reached" : "") << std::endl;
+    scheduler.report(std::cout);
+#ifdef RENDER_STATS
+    print_render_stats(std::cout, merge_render_stats());
+#endif
     start = std::chrono::high_resolution_clock::now();
 #endif
 
     // File writing
-    std::ofstream file_pgm;
-    file_pgm.open("test.pgm");
-    file_pgm << "P3\n" << nx << " " << ny << "\n255\n";
-    for (int i = 0; i < nx * ny; i++) {
-        // std::cout << img_tab[3 * i] << " " << img_tab[3 * i + 1] << " " << img_tab[3 * i + 2] << "\n";
-        file_pgm << img_tab[3 * i] << " " << img_tab[3 * i + 1] << " " << img_tab[3 * i + 2] << "\n";
+    writer.write(opts.output, format, image);
+    bool written = writer.wait();
+    if (opts.heatmap != HEATMAP_NONE) {
+        size_t dot = opts.output.rfind('.');
+        size_t slash = opts.output.rfind('/');
+        std::string stem = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? opts.output.substr(0, dot) : opts.output;
+        double scale;
+        if (!costs.write(stem, scale)) {
+            std::cerr << "cannot write " << stem << ".cost.pfm or .cost.png\n";
+            written = false;
+        }
+#ifdef MONITOR_TIME
+        const char* unit = opts.heatmap == HEATMAP_TIME ? "s" : opts.heatmap == HEATMAP_RAYS ? " rays" : " nodes and tests";
+        std::cout << "---HEATMAP--- : " << stem << ".cost.png, brightest from " << scale << unit << " per pixel" << std::endl;
+#endif
     }
-    file_pgm.close();
 
 #ifdef MONITOR_TIME
     end = std::chrono::high_resolution_clock::now();
     std::cout << "---TOTAL WRITING TIME--- : " << std::chrono::duration<float>(end - start).count() << "s" << std::endl;
 #endif
 
-    delete[] img_tab;
-    return 0;
+    return written ? 0 : 1;
 }
\ No newline at end of file